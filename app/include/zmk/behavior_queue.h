@@ -10,5 +10,17 @@
 #include <stdint.h>
 #include <zmk/behavior.h>
 
+// Queues a press or release of the behavior. Items queued for the same position run in order,
+// each one wait ms after the one before it, while items for other positions run independently.
+// Returns -ENOMEM if the queue is full.
 int zmk_behavior_queue_add(uint32_t position, const struct zmk_behavior_binding behavior,
                            bool press, uint32_t wait);
+
+// Returns the number of items that can still be queued.
+int zmk_behavior_queue_available();
+
+// Cancels the items queued for the position. Queued presses are dropped along with their
+// releases, while releases of behaviors that were already pressed run right away. Returns the
+// number of items that were dropped. Items are only told apart by position, so this cancels every
+// invocation that queued items for the position, not just the latest one.
+int zmk_behavior_queue_cancel(uint32_t position);
@@ -8,15 +8,71 @@
 
 #include <stddef.h>
 #include <kernel.h>
+#include <sys/slist.h>
 #include <zephyr/types.h>
 
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL)
+// Fixed-size block pool backing the allocations of one event type, plus usage counters.
+struct zmk_event_pool {
+    struct k_mem_slab *slab;
+    // Highest number of blocks that were in use at the same time.
+    uint32_t high_water_mark;
+    // Number of allocations that did not fit in the pool and went to the heap instead.
+    uint32_t overflows;
+    // Number of allocations that failed in both the pool and the heap.
+    uint32_t failures;
+};
+#endif
+
+// The range of the .event_subscription section holding the subscriptions of one event type. The
+// linker sorts the section by event type, and the event manager fills this in at boot.
+struct zmk_event_dispatch {
+    uint8_t offset;
+    uint8_t len;
+};
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+// Lifetime counters for one event type, measured from the first raise until the event is freed.
+struct zmk_event_type_stats {
+    uint32_t raised;
+    uint32_t freed;
+    uint32_t max_lifetime_cycles;
+    uint64_t total_lifetime_cycles;
+};
+
+// Counters for one subscription of a listener to an event type. Times include any events that
+// are raised from inside the listener.
+struct zmk_event_listener_stats {
+    uint32_t calls;
+    uint32_t captures;
+    uint32_t releases;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+};
+#endif
+
 struct zmk_event_type {
     const char *name;
+    struct zmk_event_dispatch *dispatch;
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL)
+    struct zmk_event_pool *pool;
+#endif
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+    struct zmk_event_type_stats *stats;
+#endif
 };
 
 typedef struct {
     const struct zmk_event_type *event;
     uint8_t last_listener_index;
+    // Number of captures holding the event. The event manager never frees an event that is held.
+    uint8_t capture_refs;
+    // Links the event into the capture holding it, so captured events are not copied anywhere.
+    sys_snode_t capture_node;
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+    // Cycle count when the event was first raised.
+    uint32_t raised_at;
+#endif
 } zmk_event_t;
 
 #define ZMK_EV_EVENT_BUBBLE 0
@@ -26,11 +82,17 @@ typedef struct {
 typedef int (*zmk_listener_callback_t)(const zmk_event_t *eh);
 struct zmk_listener {
     zmk_listener_callback_t callback;
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+    const char *name;
+#endif
 };
 
 struct zmk_event_subscription {
     const struct zmk_event_type *event_type;
     const struct zmk_listener *listener;
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+    struct zmk_event_listener_stats *stats;
+#endif
 };
 
 #define ZMK_EVENT_DECLARE(event_type)                                                              \
@@ -42,13 +104,44 @@ struct zmk_event_subscription {
     struct event_type *as_##event_type(const zmk_event_t *eh);                                     \
     extern const struct zmk_event_type zmk_event_##event_type;
 
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL)
+#define ZMK_EVENT_POOL_IMPL(event_type)                                                            \
+    K_MEM_SLAB_DEFINE(zmk_event_slab_##event_type, sizeof(struct event_type##_event),             \
+                      CONFIG_ZMK_EVENT_POOL_SIZE, __alignof__(struct event_type##_event));         \
+    static struct zmk_event_pool zmk_event_pool_##event_type = {                                   \
+        .slab = &zmk_event_slab_##event_type,                                                      \
+    };
+#define ZMK_EVENT_POOL_REF(event_type) .pool = &zmk_event_pool_##event_type,
+#else
+#define ZMK_EVENT_POOL_IMPL(event_type)
+#define ZMK_EVENT_POOL_REF(event_type)
+#endif
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+#define ZMK_EVENT_STATS_IMPL(event_type)                                                           \
+    static struct zmk_event_type_stats zmk_event_stats_##event_type;
+#define ZMK_EVENT_STATS_REF(event_type) .stats = &zmk_event_stats_##event_type,
+#else
+#define ZMK_EVENT_STATS_IMPL(event_type)
+#define ZMK_EVENT_STATS_REF(event_type)
+#endif
+
 #define ZMK_EVENT_IMPL(event_type)                                                                 \
-    const struct zmk_event_type zmk_event_##event_type = {.name = STRINGIFY(event_type)};          \
+    ZMK_EVENT_POOL_IMPL(event_type)                                                                \
+    ZMK_EVENT_STATS_IMPL(event_type)                                                               \
+    static struct zmk_event_dispatch zmk_event_dispatch_##event_type;                              \
+    const struct zmk_event_type zmk_event_##event_type = {                                         \
+        .name = STRINGIFY(event_type),                                                             \
+        .dispatch = &zmk_event_dispatch_##event_type,                                              \
+        ZMK_EVENT_POOL_REF(event_type) ZMK_EVENT_STATS_REF(event_type)};                           \
     const struct zmk_event_type *zmk_event_ref_##event_type __used                                 \
         __attribute__((__section__(".event_type"))) = &zmk_event_##event_type;                     \
     struct event_type##_event *new_##event_type(struct event_type data) {                          \
-        struct event_type##_event *ev =                                                            \
-            (struct event_type##_event *)k_malloc(sizeof(struct event_type##_event));              \
+        struct event_type##_event *ev = (struct event_type##_event *)zmk_event_manager_alloc(      \
+            &zmk_event_##event_type, sizeof(struct event_type##_event));                           \
+        if (ev == NULL) {                                                                          \
+            return NULL;                                                                           \
+        }                                                                                          \
         ev->header.event = &zmk_event_##event_type;                                                \
         ev->data = data;                                                                           \
         return ev;                                                                                 \
@@ -58,15 +151,35 @@ struct zmk_event_subscription {
                                                       : NULL;                                      \
     };
 
-#define ZMK_LISTENER(mod, cb) const struct zmk_listener zmk_listener_##mod = {.callback = cb};
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+#define ZMK_LISTENER_NAME(mod) .name = STRINGIFY(mod),
+#else
+#define ZMK_LISTENER_NAME(mod)
+#endif
+
+#define ZMK_LISTENER(mod, cb)                                                                      \
+    const struct zmk_listener zmk_listener_##mod = {.callback = cb, ZMK_LISTENER_NAME(mod)};
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+#define ZMK_SUBSCRIPTION_STATS_IMPL(mod, ev_type)                                                  \
+    static struct zmk_event_listener_stats _CONCAT(_CONCAT(zmk_event_sub_stats_, mod), ev_type);
+#define ZMK_SUBSCRIPTION_STATS_REF(mod, ev_type)                                                   \
+    .stats = &_CONCAT(_CONCAT(zmk_event_sub_stats_, mod), ev_type),
+#else
+#define ZMK_SUBSCRIPTION_STATS_IMPL(mod, ev_type)
+#define ZMK_SUBSCRIPTION_STATS_REF(mod, ev_type)
+#endif
 
+// The section name carries the event type so the linker groups the subscriptions of each type.
+// Subscriptions with the same name keep their link order, which is the order listeners run in.
 #define ZMK_SUBSCRIPTION(mod, ev_type)                                                             \
+    ZMK_SUBSCRIPTION_STATS_IMPL(mod, ev_type)                                                      \
     const Z_DECL_ALIGN(struct zmk_event_subscription)                                              \
         _CONCAT(_CONCAT(zmk_event_sub_, mod), ev_type) __used                                      \
-        __attribute__((__section__(".event_subscription"))) = {                                    \
+        __attribute__((__section__(".event_subscription." STRINGIFY(ev_type)))) = {                \
             .event_type = &zmk_event_##ev_type,                                                    \
             .listener = &zmk_listener_##mod,                                                       \
-    };
+            ZMK_SUBSCRIPTION_STATS_REF(mod, ev_type)};
 
 #define ZMK_EVENT_RAISE(ev) zmk_event_manager_raise((zmk_event_t *)ev);
 
@@ -78,9 +191,88 @@ struct zmk_event_subscription {
 
 #define ZMK_EVENT_RELEASE(ev) zmk_event_manager_release((zmk_event_t *)ev);
 
-#define ZMK_EVENT_FREE(ev) k_free((void *)ev);
+#define ZMK_EVENT_FREE(ev) zmk_event_manager_free((const zmk_event_t *)ev);
 
+void *zmk_event_manager_alloc(const struct zmk_event_type *type, size_t size);
+void zmk_event_manager_free(const zmk_event_t *event);
+// The raise functions return the result of the last listener that handled the event. With
+// CONFIG_ZMK_EVENT_MANAGER_DEFERRED, an event raised outside the event thread is only queued, so
+// they return 0 once it is queued, or -ENOMEM if it was raised from an ISR and the queue is full.
+// Listener errors are not reported back to such callers. Raising a NULL event, e.g. because
+// new_<event_type> could not allocate it, returns -ENOMEM.
 int zmk_event_manager_raise(zmk_event_t *event);
 int zmk_event_manager_raise_after(zmk_event_t *event, const struct zmk_listener *listener);
 int zmk_event_manager_raise_at(zmk_event_t *event, const struct zmk_listener *listener);
-int zmk_event_manager_release(zmk_event_t *event);
\ No newline at end of file
+int zmk_event_manager_release(zmk_event_t *event);
+
+// Returns the work queue that events are handled on: the event thread with
+// CONFIG_ZMK_EVENT_MANAGER_DEFERRED, the system work queue otherwise. Behavior timers are submitted
+// to it so their handlers never run while a listener is handling an event.
+struct k_work_q *zmk_event_manager_work_q();
+
+// The events captured by one listener, oldest first. The events are linked in through their own
+// header and reference counted by the event manager, so the total capture depth is measured in
+// one place. A zeroed capture is empty and ready to use.
+struct zmk_event_capture {
+    sys_slist_t events;
+    uint8_t len;
+};
+
+// Counters for the captured events of all listeners.
+struct zmk_event_capture_stats {
+    // Highest number of events that were captured at the same time, across all listeners.
+    uint32_t high_water_mark;
+    // Number of captures that failed because the event was already held by another capture.
+    uint32_t failures;
+};
+
+// Appends the event to the capture and takes a reference to it. Returns -EBUSY if another capture
+// already holds the event, in which case the caller should let it bubble.
+int zmk_event_capture_push(struct zmk_event_capture *capture, const zmk_event_t *event);
+// Removes the oldest event of the capture and drops the capture's reference to it. Returns the
+// event, or NULL if the capture is empty.
+const zmk_event_t *zmk_event_capture_pop(struct zmk_event_capture *capture);
+// Moves all events of the capture to the end of into, in order, and leaves the capture empty. The
+// list is spliced over, not copied.
+void zmk_event_capture_detach(struct zmk_event_capture *capture, struct zmk_event_capture *into);
+// Empties the capture and raises its events again, oldest first, starting at the given listener,
+// or at the first listener if it is NULL. The capture is emptied before any event is raised, so
+// listeners may capture the events again.
+void zmk_event_capture_release_all(struct zmk_event_capture *capture,
+                                   const struct zmk_listener *listener);
+
+static inline uint8_t zmk_event_capture_len(const struct zmk_event_capture *capture) {
+    return capture->len;
+}
+
+// Iterates over the entries of a capture from oldest to newest. The capture must not be modified
+// while iterating.
+#define ZMK_EVENT_CAPTURE_FOR_EACH(capture, entry)                                                 \
+    SYS_SLIST_FOR_EACH_CONTAINER(&(capture)->events, entry, node)
+
+// Number of events currently captured across all listeners.
+uint32_t zmk_event_manager_capture_depth();
+const struct zmk_event_capture_stats *zmk_event_manager_capture_stats();
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_DEFERRED)
+// Counters for the queue feeding the event thread.
+struct zmk_event_queue_stats {
+    uint32_t dispatched;
+    // Highest number of events waiting in the queue at the same time.
+    uint32_t high_water_mark;
+    // Number of times a producer had to wait because the queue was full.
+    uint32_t blocked;
+    // Number of events raised from an ISR that were dropped because the queue was full.
+    uint32_t dropped;
+    // Time between an event being queued and the event thread starting to dispatch it.
+    uint32_t max_latency_cycles;
+    uint64_t total_latency_cycles;
+};
+
+const struct zmk_event_queue_stats *zmk_event_manager_queue_stats();
+#endif
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+void zmk_event_manager_stats_reset();
+void zmk_event_manager_stats_log();
+#endif
\ No newline at end of file
@@ -8,17 +8,30 @@
 
 #include <zephyr.h>
 #include <zmk/event_manager.h>
+#include <zmk/keymap.h>
 
+// Raised once per layer state update, even if it changed several layers at once.
 struct zmk_layer_state_changed {
+    // The highest layer that changed, and whether it is now active. Check old_state and new_state
+    // to see every layer that changed.
     uint8_t layer;
     bool state;
+    zmk_keymap_layers_state_t old_state;
+    zmk_keymap_layers_state_t new_state;
     int64_t timestamp;
 };
 
 ZMK_EVENT_DECLARE(zmk_layer_state_changed);
 
-static inline struct zmk_layer_state_changed_event *create_layer_state_changed(uint8_t layer,
-                                                                               bool state) {
-    return new_zmk_layer_state_changed((struct zmk_layer_state_changed){
-        .layer = layer, .state = state, .timestamp = k_uptime_get()});
+static inline struct zmk_layer_state_changed_event *
+create_layer_state_changed(zmk_keymap_layers_state_t old_state,
+                           zmk_keymap_layers_state_t new_state) {
+    uint8_t layer = zmk_keymap_layers_highest(old_state ^ new_state);
+
+    return new_zmk_layer_state_changed(
+        (struct zmk_layer_state_changed){.layer = layer,
+                                         .state = (new_state & ZMK_KEYMAP_LAYER_BIT(layer)) != 0,
+                                         .old_state = old_state,
+                                         .new_state = new_state,
+                                         .timestamp = k_uptime_get()});
 }
@@ -6,9 +6,59 @@
 
 #pragma once
 
+#include <devicetree.h>
 #include <zmk/events/position_state_changed.h>
+#include <zmk/behavior.h>
 
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_LAYERS_STATE_8)
+typedef uint8_t zmk_keymap_layers_state_t;
+#elif IS_ENABLED(CONFIG_ZMK_KEYMAP_LAYERS_STATE_16)
+typedef uint16_t zmk_keymap_layers_state_t;
+#elif IS_ENABLED(CONFIG_ZMK_KEYMAP_LAYERS_STATE_64)
+typedef uint64_t zmk_keymap_layers_state_t;
+#else
 typedef uint32_t zmk_keymap_layers_state_t;
+#endif
+
+#define ZMK_KEYMAP_LAYERS_STATE_BITS (sizeof(zmk_keymap_layers_state_t) * 8)
+
+#define ZMK_KEYMAP_LAYER_CHILD_LEN(node) 1 +
+// The number of layers in the keymap.
+#define ZMK_KEYMAP_LAYERS_LEN                                                                      \
+    (DT_FOREACH_CHILD(DT_INST(0, zmk_keymap), ZMK_KEYMAP_LAYER_CHILD_LEN) 0)
+
+// Use this instead of BIT(), which is only as wide as unsigned long.
+#define ZMK_KEYMAP_LAYER_BIT(layer) ((zmk_keymap_layers_state_t)1 << (layer))
+
+/**
+ * Returns the highest layer set in the given layer state, or -1 if no layers are set.
+ */
+static inline int zmk_keymap_layers_highest(zmk_keymap_layers_state_t state) {
+    if (state == 0) {
+        return -1;
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_LAYERS_STATE_64)
+    return 63 - __builtin_clzll(state);
+#else
+    return 31 - __builtin_clz(state);
+#endif
+}
+
+/**
+ * Returns the lowest layer set in the given layer state, or -1 if no layers are set.
+ */
+static inline int zmk_keymap_layers_lowest(zmk_keymap_layers_state_t state) {
+    if (state == 0) {
+        return -1;
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_LAYERS_STATE_64)
+    return __builtin_ctzll(state);
+#else
+    return __builtin_ctz(state);
+#endif
+}
 
 uint8_t zmk_keymap_layer_default();
 zmk_keymap_layers_state_t zmk_keymap_layer_state();
@@ -18,8 +68,35 @@ int zmk_keymap_layer_activate(uint8_t layer);
 int zmk_keymap_layer_deactivate(uint8_t layer);
 int zmk_keymap_layer_toggle(uint8_t layer);
 int zmk_keymap_layer_to(uint8_t layer);
+/**
+ * Sets every layer in mask to the matching bit of state, e.g. mask BIT(1) | BIT(2) and state
+ * BIT(2) deactivates layer 1 and activates layer 2. All changes are reported with a single
+ * zmk_layer_state_changed event.
+ */
+int zmk_keymap_layer_state_set(zmk_keymap_layers_state_t mask, zmk_keymap_layers_state_t state);
 const char *zmk_keymap_layer_label(uint8_t layer);
 
+/**
+ * Returns the binding for a key position on a layer, or NULL if either is out of range.
+ */
+const struct zmk_behavior_binding *zmk_keymap_binding_get(uint8_t layer, uint32_t position);
+
+/**
+ * Replaces the binding for a key position on a layer. The change takes effect on the next press,
+ * and is saved to settings after CONFIG_ZMK_SETTINGS_SAVE_DEBOUNCE milliseconds together with any
+ * other changes made in the meantime.
+ *
+ * @retval -EINVAL if the layer, position or behavior doesn't exist.
+ * @retval -ENOTSUP if CONFIG_ZMK_KEYMAP_SETTINGS_STORAGE is disabled.
+ */
+int zmk_keymap_binding_set(uint8_t layer, uint32_t position,
+                           const struct zmk_behavior_binding *binding);
+
+/**
+ * Saves any pending binding changes to settings immediately.
+ */
+int zmk_keymap_save_bindings();
+
 int zmk_keymap_position_state_changed(uint8_t source, uint32_t position, bool pressed,
                                       int64_t timestamp);
 
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <kernel.h>
+#include <sys/dlist.h>
+
+/*
+ * A lightweight timer service for behavior timeouts. All timers share a single kernel delayable
+ * work item that is only rescheduled when the earliest pending deadline changes. Handlers run on
+ * the work queue that events are handled on (see zmk_event_manager_work_q), so they never run
+ * while a listener is handling an event.
+ */
+
+struct zmk_timer;
+
+typedef void (*zmk_timer_handler_t)(struct zmk_timer *timer);
+
+struct zmk_timer {
+    sys_dnode_t node;
+    // the k_uptime_get() timestamp at which the timer expires.
+    int64_t deadline;
+    zmk_timer_handler_t handler;
+};
+
+void zmk_timer_init(struct zmk_timer *timer, zmk_timer_handler_t handler);
+
+// Starts the timer so it expires at the given k_uptime_get() timestamp. A timer that is already
+// pending is moved to the new deadline.
+void zmk_timer_start(struct zmk_timer *timer, int64_t deadline);
+
+// Stops the timer. Does nothing if the timer is not pending.
+void zmk_timer_cancel(struct zmk_timer *timer);
+
+bool zmk_timer_is_pending(const struct zmk_timer *timer);
+
+// Returns the earliest pending deadline, or LLONG_MAX if no timer is pending.
+int64_t zmk_timer_next_deadline(void);
@@ -6,61 +6,276 @@
 
 #include <zmk/behavior_queue.h>
 
+#include <init.h>
 #include <kernel.h>
 #include <logging/log.h>
+#include <sys/dlist.h>
 #include <drivers/behavior.h>
 
+#include <zmk/timer.h>
+
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
+#define QUEUE_SIZE CONFIG_ZMK_BEHAVIORS_QUEUE_SIZE
+// the number of streams whose next due time is remembered after their last item has run.
+#define QUEUE_STREAMS CONFIG_ZMK_BEHAVIORS_QUEUE_STREAMS
+
 struct q_item {
+    sys_dnode_t node;
+    // the k_uptime_get() timestamp at which the behavior is invoked.
+    int64_t due;
     uint32_t position;
     struct zmk_behavior_binding binding;
     bool press : 1;
     uint32_t wait : 31;
 };
 
-K_MSGQ_DEFINE(zmk_behavior_queue_msgq, sizeof(struct q_item), CONFIG_ZMK_BEHAVIORS_QUEUE_SIZE, 4);
+// Items queued for the same position form a stream: each one is due wait ms after the one before
+// it. This remembers when the next item of a stream is due, so a stream whose last item already
+// ran still waits for that item's wait time.
+struct q_stream {
+    uint32_t position;
+    int64_t next_due;
+};
+
+static struct q_item items[QUEUE_SIZE];
+// items that are not in use.
+static sys_dlist_t free_items = SYS_DLIST_STATIC_INIT(&free_items);
+// queued items, sorted by due time. Items with equal due times run in the order they were added.
+static sys_dlist_t pending = SYS_DLIST_STATIC_INIT(&pending);
+static int free_count = 0;
 
-static void behavior_queue_process_next(struct k_work *work);
-static K_WORK_DELAYABLE_DEFINE(queue_work, behavior_queue_process_next);
+static struct q_stream streams[QUEUE_STREAMS];
+// the latest next due time of a stream that had to be forgotten to make room for another one.
+// Streams that are not remembered wait for it, so the forgotten stream never runs early.
+static int64_t forgotten_next_due = 0;
 
-static void behavior_queue_process_next(struct k_work *work) {
-    struct q_item item = {.wait = 0};
+static struct zmk_timer queue_timer;
+static bool processing = false;
+// protects all of the queue state above. Items are added from the threads that invoke behaviors,
+// while the queue is processed from the timer.
+static struct k_spinlock lock;
+
+static int64_t stream_next_due(uint32_t position, int64_t now) {
+    for (int i = 0; i < QUEUE_STREAMS; i++) {
+        if (streams[i].next_due > now && streams[i].position == position) {
+            return streams[i].next_due;
+        }
+    }
+    return MAX(now, forgotten_next_due);
+}
 
-    while (k_msgq_get(&zmk_behavior_queue_msgq, &item, K_NO_WAIT) == 0) {
-        LOG_DBG("Invoking %s: 0x%02x 0x%02x", log_strdup(item.binding.behavior_dev),
-                item.binding.param1, item.binding.param2);
+static void set_stream_next_due(uint32_t position, int64_t next_due, int64_t now) {
+    struct q_stream *slot = &streams[0];
 
-        struct zmk_behavior_binding_event event = {.position = item.position,
-                                                   .timestamp = k_uptime_get()};
+    // reuse the slot of this stream if there is one, otherwise the one that is due first.
+    for (int i = 0; i < QUEUE_STREAMS; i++) {
+        if (streams[i].position == position && streams[i].next_due > now) {
+            slot = &streams[i];
+            break;
+        }
+        if (streams[i].next_due < slot->next_due) {
+            slot = &streams[i];
+        }
+    }
+
+    if (slot->position != position && slot->next_due > now) {
+        forgotten_next_due = MAX(forgotten_next_due, slot->next_due);
+    }
+
+    slot->position = position;
+    slot->next_due = next_due;
+}
 
-        if (item.press) {
-            behavior_keymap_binding_pressed(&item.binding, event);
+static void insert_pending(struct q_item *item) {
+    // items are usually due at or after the ones already queued, so search from the back.
+    struct q_item *prev = SYS_DLIST_PEEK_TAIL_CONTAINER(&pending, prev, node);
+    while (prev != NULL && prev->due > item->due) {
+        prev = SYS_DLIST_PEEK_PREV_CONTAINER(&pending, prev, node);
+    }
+    struct q_item *next = prev == NULL ? SYS_DLIST_PEEK_HEAD_CONTAINER(&pending, next, node)
+                                       : SYS_DLIST_PEEK_NEXT_CONTAINER(&pending, prev, node);
+    if (next == NULL) {
+        sys_dlist_append(&pending, &item->node);
+    } else {
+        sys_dlist_insert(&next->node, &item->node);
+    }
+}
+
+static inline bool same_binding(const struct zmk_behavior_binding *a,
+                                const struct zmk_behavior_binding *b) {
+    return a->behavior_dev == b->behavior_dev && a->param1 == b->param1 && a->param2 == b->param2;
+}
+
+static void free_item(struct q_item *item) {
+    sys_dlist_append(&free_items, &item->node);
+    free_count++;
+}
+
+static void behavior_queue_process_next() {
+    struct q_item *item;
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    // Items added while the queue is being processed, from this thread or another one, are picked
+    // up by the running loop.
+    if (processing) {
+        k_spin_unlock(&lock, key);
+        return;
+    }
+
+    processing = true;
+    while ((item = SYS_DLIST_PEEK_HEAD_CONTAINER(&pending, item, node)) != NULL &&
+           item->due <= k_uptime_get()) {
+        sys_dlist_remove(&item->node);
+
+        struct zmk_behavior_binding binding = item->binding;
+        bool press = item->press;
+        uint32_t wait = item->wait;
+        // the event is stamped with the time the item was due, so delays in running the queue
+        // do not add up over a long macro.
+        struct zmk_behavior_binding_event event = {.position = item->position,
+                                                   .timestamp = item->due};
+        free_item(item);
+
+        // behaviors are invoked without holding the lock, as they may queue more items.
+        k_spin_unlock(&lock, key);
+
+        LOG_DBG("Invoking %s: 0x%02x 0x%02x", log_strdup(binding.behavior_dev), binding.param1,
+                binding.param2);
+
+        if (press) {
+            behavior_keymap_binding_pressed(&binding, event);
         } else {
-            behavior_keymap_binding_released(&item.binding, event);
+            behavior_keymap_binding_released(&binding, event);
         }
 
-        LOG_DBG("Processing next queued behavior in %dms", item.wait);
+        LOG_DBG("Processing next queued behavior in %dms", wait);
 
-        if (item.wait > 0) {
-            k_work_schedule(&queue_work, K_MSEC(item.wait));
-            break;
+        key = k_spin_lock(&lock);
+    }
+    processing = false;
+
+    if (item == NULL) {
+        zmk_timer_cancel(&queue_timer);
+    } else {
+        zmk_timer_start(&queue_timer, item->due);
+    }
+    k_spin_unlock(&lock, key);
+}
+
+static void queue_timer_handler(struct zmk_timer *timer) { behavior_queue_process_next(); }
+
+int zmk_behavior_queue_cancel(uint32_t position) {
+    // presses of the stream that are dropped, which their releases are matched against.
+    sys_dlist_t dropped;
+    // releases of behaviors that were already pressed, which still have to run.
+    sys_dlist_t finishing;
+    struct q_item *item, *tmp;
+    int cancelled = 0;
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    sys_dlist_init(&dropped);
+    sys_dlist_init(&finishing);
+
+    SYS_DLIST_FOR_EACH_CONTAINER_SAFE(&pending, item, tmp, node) {
+        if (item->position != position) {
+            continue;
         }
+        sys_dlist_remove(&item->node);
+
+        if (item->press) {
+            sys_dlist_append(&dropped, &item->node);
+            continue;
+        }
+
+        struct q_item *press;
+        bool matched = false;
+        SYS_DLIST_FOR_EACH_CONTAINER(&dropped, press, node) {
+            if (same_binding(&press->binding, &item->binding)) {
+                matched = true;
+                break;
+            }
+        }
+
+        if (matched) {
+            sys_dlist_remove(&press->node);
+            free_item(press);
+            free_item(item);
+            cancelled += 2;
+        } else {
+            sys_dlist_append(&finishing, &item->node);
+        }
+    }
+
+    while ((item = SYS_DLIST_PEEK_HEAD_CONTAINER(&dropped, item, node)) != NULL) {
+        sys_dlist_remove(&item->node);
+        free_item(item);
+        cancelled++;
     }
+
+    // release what was already pressed right away, so nothing stays held.
+    int64_t now = k_uptime_get();
+    while ((item = SYS_DLIST_PEEK_HEAD_CONTAINER(&finishing, item, node)) != NULL) {
+        sys_dlist_remove(&item->node);
+        item->due = now;
+        item->wait = 0;
+        insert_pending(item);
+    }
+    set_stream_next_due(position, now, now);
+    k_spin_unlock(&lock, key);
+
+    LOG_DBG("Cancelled %d queued behaviors for position %d", cancelled, position);
+
+    behavior_queue_process_next();
+
+    return cancelled;
+}
+
+int zmk_behavior_queue_available() {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    int available = free_count;
+    k_spin_unlock(&lock, key);
+    return available;
 }
 
 int zmk_behavior_queue_add(uint32_t position, const struct zmk_behavior_binding binding, bool press,
                            uint32_t wait) {
-    struct q_item item = {.press = press, .binding = binding, .wait = wait};
-
-    const int ret = k_msgq_put(&zmk_behavior_queue_msgq, &item, K_NO_WAIT);
-    if (ret < 0) {
-        return ret;
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    sys_dnode_t *node = sys_dlist_get(&free_items);
+    if (node == NULL) {
+        k_spin_unlock(&lock, key);
+        LOG_ERR("Behavior queue is full, increase CONFIG_ZMK_BEHAVIORS_QUEUE_SIZE");
+        return -ENOMEM;
     }
+    free_count--;
 
-    if (!k_work_delayable_is_pending(&queue_work)) {
-        behavior_queue_process_next(&queue_work.work);
-    }
+    struct q_item *item = CONTAINER_OF(node, struct q_item, node);
+    int64_t now = k_uptime_get();
+
+    *item = (struct q_item){
+        .due = stream_next_due(position, now),
+        .position = position,
+        .binding = binding,
+        .press = press,
+        .wait = wait,
+    };
+    set_stream_next_due(position, item->due + wait, now);
+    insert_pending(item);
+    k_spin_unlock(&lock, key);
+
+    // Run items that are already due right away, like invoking the behavior directly would.
+    behavior_queue_process_next();
+
+    return 0;
+}
 
+static int behavior_queue_init(const struct device *_arg) {
+    for (int i = 0; i < QUEUE_SIZE; i++) {
+        sys_dlist_append(&free_items, &items[i].node);
+    }
+    free_count = QUEUE_SIZE;
+    zmk_timer_init(&queue_timer, queue_timer_handler);
     return 0;
 }
+
+SYS_INIT(behavior_queue_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
@@ -10,7 +10,10 @@
 #include <drivers/behavior.h>
 #include <zmk/keys.h>
 #include <dt-bindings/zmk/keys.h>
+#include <init.h>
 #include <logging/log.h>
+#include <stdlib.h>
+#include <sys/printk.h>
 #include <zmk/behavior.h>
 #include <zmk/matrix.h>
 #include <zmk/endpoints.h>
@@ -20,12 +23,16 @@
 #include <zmk/behavior.h>
 #include <zmk/keymap.h>
 
+#if IS_ENABLED(CONFIG_ZMK_BEHAVIORS_HOLD_TAP_TIMELINE) && IS_ENABLED(CONFIG_SHELL)
+#include <shell/shell.h>
+#endif
+
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #if DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT)
 
-#define ZMK_BHV_HOLD_TAP_MAX_HELD 10
-#define ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS 40
+#define ZMK_BHV_HOLD_TAP_MAX_HELD CONFIG_ZMK_BEHAVIORS_HOLD_TAP_MAX_HELD
+#define ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS CONFIG_ZMK_BEHAVIORS_HOLD_TAP_MAX_CAPTURED_EVENTS
 
 // increase if you have keyboard with more keys.
 #define ZMK_BHV_HOLD_TAP_POSITION_NOT_USED 9999
@@ -35,6 +42,7 @@ enum flavor {
     FLAVOR_BALANCED,
     FLAVOR_TAP_PREFERRED,
     FLAVOR_TAP_UNLESS_INTERRUPTED,
+    FLAVOR_ADAPTIVE,
 };
 
 enum status {
@@ -58,6 +66,7 @@ struct behavior_hold_tap_config {
     char *tap_behavior_dev;
     int quick_tap_ms;
     bool global_quick_tap;
+    int require_prior_idle_ms;
     enum flavor flavor;
     bool retro_tap;
     int32_t hold_trigger_key_positions_len;
@@ -70,6 +79,8 @@ struct active_hold_tap {
     uint32_t param_hold;
     uint32_t param_tap;
     int64_t timestamp;
+    // the tapping term for this press, which the adaptive flavor may shorten.
+    int32_t tapping_term_ms;
     enum status status;
     const struct behavior_hold_tap_config *config;
     struct k_work_delayable work;
@@ -77,6 +88,7 @@ struct active_hold_tap {
 
     // initialized to -1, which is to be interpreted as "no other key has been pressed yet"
     int32_t position_of_first_other_key_pressed;
+    int64_t timestamp_of_first_other_key_pressed;
 };
 
 // The undecided hold tap is the hold tap that needs to be decided before
@@ -86,8 +98,19 @@ struct active_hold_tap {
 // its key-up has been processed and the delayed work is cleaned up.
 struct active_hold_tap *undecided_hold_tap = NULL;
 struct active_hold_tap active_hold_taps[ZMK_BHV_HOLD_TAP_MAX_HELD] = {};
+// bit i is set while active_hold_taps[i] is in use.
+uint32_t active_hold_taps_used = 0;
+#define ACTIVE_HOLD_TAPS_MASK ((uint32_t)((1ULL << ZMK_BHV_HOLD_TAP_MAX_HELD) - 1))
 // We capture most position_state_changed events and some modifiers_state_changed events.
-const zmk_event_t *captured_events[ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS] = {};
+// The events are linked into captured_events through their own headers by the event manager.
+struct zmk_event_capture captured_events = {};
+// the last captured keydown event for each key position, so key-up events can be matched to it
+// without searching captured_events.
+struct zmk_position_state_changed *captured_keydown_events[ZMK_KEYMAP_LEN] = {};
+
+BUILD_ASSERT(ZMK_BHV_HOLD_TAP_MAX_HELD <= 32, "active_hold_taps_used can track 32 hold-taps");
+BUILD_ASSERT(ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS <= UINT8_MAX,
+             "captured_events can hold up to 255 events");
 
 // Keep track of which key was tapped most recently for the standard, if it is a hold-tap
 // a position, will be given, if not it will just be INT32_MIN
@@ -98,6 +121,84 @@ struct last_tapped {
 
 struct last_tapped last_tapped = {INT32_MIN, INT64_MIN};
 
+// The adaptive flavor keeps a model of how long each hold-tap position is held when it is tapped.
+struct tap_model {
+    // rolling average of the tap duration and its mean deviation, in milliseconds.
+    uint16_t average_ms;
+    uint16_t deviation_ms;
+    uint8_t samples;
+};
+
+// the model is only trusted once it has seen this many taps.
+#define TAP_MODEL_MIN_SAMPLES 4
+
+#define ADAPTIVE_FLAVOR_INST(n) +(DT_ENUM_IDX(DT_DRV_INST(n), flavor) == FLAVOR_ADAPTIVE)
+#define ADAPTIVE_FLAVOR_COUNT (0 DT_INST_FOREACH_STATUS_OKAY(ADAPTIVE_FLAVOR_INST))
+// models are only allocated if any hold-tap uses the adaptive flavor.
+#define TAP_MODELS_LEN (ADAPTIVE_FLAVOR_COUNT > 0 ? ZMK_KEYMAP_LEN : 0)
+
+struct tap_model tap_models[TAP_MODELS_LEN] = {};
+
+static struct tap_model *find_tap_model(const struct active_hold_tap *hold_tap) {
+    if (hold_tap->config->flavor != FLAVOR_ADAPTIVE || hold_tap->position < 0 ||
+        hold_tap->position >= TAP_MODELS_LEN) {
+        return NULL;
+    }
+    return &tap_models[hold_tap->position];
+}
+
+static struct tap_model *find_trusted_tap_model(const struct active_hold_tap *hold_tap) {
+    struct tap_model *model = find_tap_model(hold_tap);
+    if (model == NULL || model->samples < TAP_MODEL_MIN_SAMPLES) {
+        return NULL;
+    }
+    return model;
+}
+
+// A trusted model shortens the tapping term to well above the usual tap duration, so a key that is
+// held longer than it is ever tapped resolves to a hold sooner.
+static int32_t adaptive_tapping_term_ms(const struct active_hold_tap *hold_tap) {
+    struct tap_model *model = find_trusted_tap_model(hold_tap);
+    if (model == NULL) {
+        return hold_tap->config->tapping_term_ms;
+    }
+    int32_t term = MAX(2 * model->average_ms, model->average_ms + 4 * model->deviation_ms);
+    return MIN(term, hold_tap->config->tapping_term_ms);
+}
+
+// Another key pressed sooner than the hold-tap is usually held for a tap is a roll while typing.
+static bool is_rolled_over(const struct active_hold_tap *hold_tap) {
+    struct tap_model *model = find_trusted_tap_model(hold_tap);
+    if (model == NULL || hold_tap->position_of_first_other_key_pressed == -1) {
+        return false;
+    }
+    return hold_tap->timestamp_of_first_other_key_pressed - hold_tap->timestamp <
+           model->average_ms;
+}
+
+static void update_tap_model(const struct active_hold_tap *hold_tap, int64_t released_at) {
+    struct tap_model *model = find_tap_model(hold_tap);
+    int32_t duration = released_at - hold_tap->timestamp;
+    if (model == NULL || hold_tap->status != STATUS_TAP || duration < 0 ||
+        duration >= hold_tap->config->tapping_term_ms) {
+        return;
+    }
+
+    if (model->samples == 0) {
+        model->average_ms = duration;
+        model->deviation_ms = duration / 2;
+    } else {
+        int32_t error = duration - model->average_ms;
+        model->deviation_ms += (abs(error) - model->deviation_ms) / 4;
+        model->average_ms += error / 4;
+    }
+    if (model->samples < UINT8_MAX) {
+        model->samples++;
+    }
+    LOG_DBG("%d tap model %dms, deviation %dms after %d taps", hold_tap->position,
+            model->average_ms, model->deviation_ms, model->samples);
+}
+
 static void store_last_tapped(int64_t timestamp) {
     if (timestamp > last_tapped.timestamp) {
         last_tapped.position = INT32_MIN;
@@ -111,6 +212,12 @@ static void store_last_hold_tapped(struct active_hold_tap *hold_tap) {
 }
 
 static bool is_quick_tap(struct active_hold_tap *hold_tap) {
+    // any key pressed within require-prior-idle-ms before the hold-tap makes it a tap, so hold-taps
+    // pressed while typing don't wait for a decision.
+    if (hold_tap->config->require_prior_idle_ms > 0 &&
+        (last_tapped.timestamp + hold_tap->config->require_prior_idle_ms) > hold_tap->timestamp) {
+        return true;
+    }
     if (hold_tap->config->global_quick_tap || last_tapped.position == hold_tap->position) {
         return (last_tapped.timestamp + hold_tap->config->quick_tap_ms) > hold_tap->timestamp;
     } else {
@@ -119,32 +226,27 @@ static bool is_quick_tap(struct active_hold_tap *hold_tap) {
 }
 
 static int capture_event(const zmk_event_t *event) {
-    for (int i = 0; i < ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS; i++) {
-        if (captured_events[i] == NULL) {
-            captured_events[i] = event;
-            return 0;
-        }
+    if (zmk_event_capture_len(&captured_events) == ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS) {
+        return -ENOMEM;
+    }
+    int ret = zmk_event_capture_push(&captured_events, event);
+    if (ret < 0) {
+        return ret;
+    }
+
+    struct zmk_position_state_changed *position_event = as_zmk_position_state_changed(event);
+    if (position_event != NULL && position_event->state &&
+        position_event->position < ZMK_KEYMAP_LEN) {
+        captured_keydown_events[position_event->position] = position_event;
     }
-    return -ENOMEM;
+    return 0;
 }
 
 static struct zmk_position_state_changed *find_captured_keydown_event(uint32_t position) {
-    struct zmk_position_state_changed *last_match = NULL;
-    for (int i = 0; i < ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS; i++) {
-        const zmk_event_t *eh = captured_events[i];
-        if (eh == NULL) {
-            return last_match;
-        }
-        struct zmk_position_state_changed *position_event = as_zmk_position_state_changed(eh);
-        if (position_event == NULL) {
-            continue;
-        }
-
-        if (position_event->position == position && position_event->state) {
-            last_match = position_event;
-        }
+    if (position >= ZMK_KEYMAP_LEN) {
+        return NULL;
     }
-    return last_match;
+    return captured_keydown_events[position];
 }
 
 const struct zmk_listener zmk_listener_behavior_hold_tap;
@@ -154,56 +256,33 @@ static void release_captured_events() {
         return;
     }
 
-    // We use a trick to prevent copying the captured_events array.
-    //
-    // Events for different mod-tap instances are separated by a NULL pointer.
-    //
-    // The first event popped will never be catched by the next active hold-tap
-    // because to start capturing a mod-tap-key-down event must first completely
-    // go through the events queue.
+    // The captured events are detached from captured_events before any of them is raised again.
+    // Raising them may start a new undecided hold-tap, which then captures the events that follow
+    // into the now empty captured_events. Once that hold-tap is decided, it releases only its own
+    // events before this release continues with the rest.
     //
     // Example of this release process;
-    // [mt2_down, k1_down, k1_up, mt2_up, null, ...]
-    //  ^
+    // captured: [mt2_down, k1_down, k1_up, mt2_up], releasing: []
+    // all events are moved out first:
+    // captured: [], releasing: [mt2_down, k1_down, k1_up, mt2_up]
     // mt2_down position event isn't captured because no hold-tap is active.
     // mt2_down behavior event is handled, now we have an undecided hold-tap
-    // [null, k1_down, k1_up, mt2_up, null, ...]
-    //        ^
-    // k1_down  is captured by the mt2 mod-tap
-    // !note that searches for find_captured_keydown_event by the mt2 behavior will stop at the
-    // first null encountered [mt1_down, null, k1_up, mt2_up, null, ...]
-    //                  ^
-    // k1_up event is captured by the new hold-tap:
-    // [k1_down, k1_up, null, mt2_up, null, ...]
-    //                        ^
-    // mt2_up event is not captured but causes release of mt2 behavior
-    // [k1_down, k1_up, null, null, null, ...]
+    // captured: [], releasing: [k1_down, k1_up, mt2_up]
+    // k1_down is captured by the mt2 hold-tap, and so is k1_up.
+    // captured: [k1_down, k1_up], releasing: [mt2_up]
+    // mt2_up event is not captured but causes release of mt2 behavior,
     // now mt2 will start releasing it's own captured positions.
-    for (int i = 0; i < ZMK_BHV_HOLD_TAP_MAX_CAPTURED_EVENTS; i++) {
-        const zmk_event_t *captured_event = captured_events[i];
-        if (captured_event == NULL) {
-            return;
-        }
-        captured_events[i] = NULL;
-        if (undecided_hold_tap != NULL) {
-            k_msleep(10);
-        }
-
-        struct zmk_position_state_changed *position_event;
-        struct zmk_keycode_state_changed *modifier_event;
-        if ((position_event = as_zmk_position_state_changed(captured_event)) != NULL) {
-            LOG_DBG("Releasing key position event for position %d %s", position_event->position,
-                    (position_event->state ? "pressed" : "released"));
-        } else if ((modifier_event = as_zmk_keycode_state_changed(captured_event)) != NULL) {
-            LOG_DBG("Releasing mods changed event 0x%02X %s", modifier_event->keycode,
-                    (modifier_event->state ? "pressed" : "released"));
-        }
-        ZMK_EVENT_RAISE_AT(captured_event, behavior_hold_tap);
-    }
+    memset(captured_keydown_events, 0, sizeof(captured_keydown_events));
+    zmk_event_capture_release_all(&captured_events, &zmk_listener_behavior_hold_tap);
 }
 
+// iterates over the indices of the active hold-taps, without visiting the unused slots.
+#define FOR_EACH_ACTIVE_HOLD_TAP(i)                                                                \
+    for (uint32_t _used = active_hold_taps_used, i = 0;                                           \
+         _used != 0 && ((i = find_lsb_set(_used) - 1), true); _used &= _used - 1)
+
 static struct active_hold_tap *find_hold_tap(uint32_t position) {
-    for (int i = 0; i < ZMK_BHV_HOLD_TAP_MAX_HELD; i++) {
+    FOR_EACH_ACTIVE_HOLD_TAP(i) {
         if (active_hold_taps[i].position == position) {
             return &active_hold_taps[i];
         }
@@ -214,10 +293,10 @@ static struct active_hold_tap *find_hold_tap(uint32_t position) {
 static struct active_hold_tap *store_hold_tap(uint32_t position, uint32_t param_hold,
                                               uint32_t param_tap, int64_t timestamp,
                                               const struct behavior_hold_tap_config *config) {
-    for (int i = 0; i < ZMK_BHV_HOLD_TAP_MAX_HELD; i++) {
-        if (active_hold_taps[i].position != ZMK_BHV_HOLD_TAP_POSITION_NOT_USED) {
-            continue;
-        }
+    uint32_t unused = ~active_hold_taps_used & ACTIVE_HOLD_TAPS_MASK;
+    if (unused != 0) {
+        int i = find_lsb_set(unused) - 1;
+        active_hold_taps_used |= BIT(i);
         active_hold_taps[i].position = position;
         active_hold_taps[i].status = STATUS_UNDECIDED;
         active_hold_taps[i].config = config;
@@ -231,6 +310,7 @@ static struct active_hold_tap *store_hold_tap(uint32_t position, uint32_t param_
 }
 
 static void clear_hold_tap(struct active_hold_tap *hold_tap) {
+    active_hold_taps_used &= ~BIT(hold_tap - active_hold_taps);
     hold_tap->position = ZMK_BHV_HOLD_TAP_POSITION_NOT_USED;
     hold_tap->status = STATUS_UNDECIDED;
     hold_tap->work_is_cancelled = false;
@@ -310,6 +390,31 @@ static void decide_hold_preferred(struct active_hold_tap *hold_tap, enum decisio
     }
 }
 
+static void decide_adaptive(struct active_hold_tap *hold_tap, enum decision_moment event) {
+    switch (event) {
+    case HT_KEY_UP:
+        hold_tap->status = STATUS_TAP;
+        return;
+    case HT_OTHER_KEY_DOWN:
+        // without a trusted model, this behaves like the balanced flavor.
+        if (is_rolled_over(hold_tap)) {
+            hold_tap->status = STATUS_TAP;
+        }
+        return;
+    case HT_OTHER_KEY_UP:
+        hold_tap->status = STATUS_HOLD_INTERRUPT;
+        return;
+    case HT_TIMER_EVENT:
+        hold_tap->status = STATUS_HOLD_TIMER;
+        return;
+    case HT_QUICK_TAP:
+        hold_tap->status = STATUS_TAP;
+        return;
+    default:
+        return;
+    }
+}
+
 static inline const char *flavor_str(enum flavor flavor) {
     switch (flavor) {
     case FLAVOR_HOLD_PREFERRED:
@@ -320,6 +425,8 @@ static inline const char *flavor_str(enum flavor flavor) {
         return "tap-preferred";
     case FLAVOR_TAP_UNLESS_INTERRUPTED:
         return "tap-unless-interrupted";
+    case FLAVOR_ADAPTIVE:
+        return "adaptive";
     default:
         return "UNKNOWN FLAVOR";
     }
@@ -357,6 +464,130 @@ static inline const char *decision_moment_str(enum decision_moment decision_mome
     }
 }
 
+#if IS_ENABLED(CONFIG_ZMK_BEHAVIORS_HOLD_TAP_TIMELINE)
+
+#define TIMELINE_SIZE CONFIG_ZMK_BEHAVIORS_HOLD_TAP_TIMELINE_SIZE
+#define TIMELINE_NO_POSITION UINT16_MAX
+
+// one hold-tap decision, kept small so recording it is only a few stores.
+struct decision_record {
+    uint16_t position;
+    // the key whose press or release caused the decision, or TIMELINE_NO_POSITION.
+    uint16_t interrupting_position;
+    // time from the hold-tap press to the decision, saturated at UINT16_MAX.
+    uint16_t elapsed_ms;
+    uint8_t flavor : 4;
+    uint8_t status : 4;
+    uint8_t decision_moment;
+};
+
+// the most recent decisions. Entry i % TIMELINE_SIZE holds decision number i.
+static struct decision_record timeline[TIMELINE_SIZE];
+static uint32_t timeline_count = 0;
+
+// decided_at is the timestamp of the event that caused the decision, or the end of the tapping
+// term for timer decisions, so a late timer or a queued event does not skew elapsed_ms.
+static void record_decision(struct active_hold_tap *hold_tap, enum decision_moment decision_moment,
+                            int32_t interrupting_position, int64_t decided_at) {
+    int64_t elapsed = decided_at - hold_tap->timestamp;
+    timeline[timeline_count % TIMELINE_SIZE] = (struct decision_record){
+        .position = hold_tap->position,
+        .interrupting_position =
+            interrupting_position < 0 ? TIMELINE_NO_POSITION : interrupting_position,
+        .elapsed_ms = CLAMP(elapsed, 0, UINT16_MAX),
+        .flavor = hold_tap->config->flavor,
+        .status = hold_tap->status,
+        .decision_moment = decision_moment,
+    };
+    timeline_count++;
+}
+
+static void format_decision(char *buf, size_t len, uint32_t index) {
+    const struct decision_record *record = &timeline[index % TIMELINE_SIZE];
+    int written = snprintk(buf, len, "#%u %d %s %s at %s after %ums", index, record->position,
+                           flavor_str(record->flavor), status_str(record->status),
+                           decision_moment_str(record->decision_moment), record->elapsed_ms);
+    if (record->interrupting_position != TIMELINE_NO_POSITION && written > 0 &&
+        written < (int)len) {
+        snprintk(buf + written, len - written, " by %d", record->interrupting_position);
+    }
+}
+
+// the index of the oldest decision that is still in the timeline.
+static inline uint32_t timeline_start() {
+    return timeline_count > TIMELINE_SIZE ? timeline_count - TIMELINE_SIZE : 0;
+}
+
+#if CONFIG_ZMK_BEHAVIORS_HOLD_TAP_TIMELINE_LOG_INTERVAL > 0
+
+static uint32_t timeline_logged = 0;
+
+static void timeline_log_work_handler(struct k_work *work) {
+    char line[96];
+
+    for (uint32_t i = MAX(timeline_logged, timeline_start()); i < timeline_count; i++) {
+        format_decision(line, sizeof(line), i);
+        LOG_INF("hold-tap decision %s", log_strdup(line));
+    }
+    timeline_logged = timeline_count;
+
+    k_work_schedule(k_work_delayable_from_work(work),
+                    K_MSEC(CONFIG_ZMK_BEHAVIORS_HOLD_TAP_TIMELINE_LOG_INTERVAL));
+}
+
+static K_WORK_DELAYABLE_DEFINE(timeline_log_work, timeline_log_work_handler);
+
+static int timeline_log_init(const struct device *_arg) {
+    k_work_schedule(&timeline_log_work,
+                    K_MSEC(CONFIG_ZMK_BEHAVIORS_HOLD_TAP_TIMELINE_LOG_INTERVAL));
+    return 0;
+}
+
+SYS_INIT(timeline_log_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#endif /* CONFIG_ZMK_BEHAVIORS_HOLD_TAP_TIMELINE_LOG_INTERVAL > 0 */
+
+#if IS_ENABLED(CONFIG_SHELL)
+
+static int cmd_hold_tap_timeline(const struct shell *shell, size_t argc, char **argv) {
+    char line[96];
+
+    shell_print(shell, "%u hold-tap decisions recorded", timeline_count);
+    for (uint32_t i = timeline_start(); i < timeline_count; i++) {
+        format_decision(line, sizeof(line), i);
+        shell_print(shell, "  %s", line);
+    }
+    return 0;
+}
+
+static int cmd_hold_tap_clear(const struct shell *shell, size_t argc, char **argv) {
+    timeline_count = 0;
+#if CONFIG_ZMK_BEHAVIORS_HOLD_TAP_TIMELINE_LOG_INTERVAL > 0
+    timeline_logged = 0;
+#endif
+    shell_print(shell, "Hold-tap timeline cleared");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_hold_tap,
+                               SHELL_CMD(timeline, NULL, "Print the recent hold-tap decisions",
+                                         cmd_hold_tap_timeline),
+                               SHELL_CMD(clear, NULL, "Clear the hold-tap timeline",
+                                         cmd_hold_tap_clear),
+                               SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(hold_tap, &sub_hold_tap, "Hold-tap behavior commands", NULL);
+
+#endif /* IS_ENABLED(CONFIG_SHELL) */
+
+#else
+
+static inline void record_decision(struct active_hold_tap *hold_tap,
+                                   enum decision_moment decision_moment,
+                                   int32_t interrupting_position, int64_t decided_at) {}
+
+#endif /* IS_ENABLED(CONFIG_ZMK_BEHAVIORS_HOLD_TAP_TIMELINE) */
+
 static int press_binding(struct active_hold_tap *hold_tap) {
     if (hold_tap->config->retro_tap && hold_tap->status == STATUS_HOLD_TIMER) {
         return 0;
@@ -433,8 +664,11 @@ static void decide_positional_hold(struct active_hold_tap *hold_tap) {
     hold_tap->status = STATUS_TAP;
 }
 
-static void decide_hold_tap(struct active_hold_tap *hold_tap,
-                            enum decision_moment decision_moment) {
+// interrupting_position is the position of the other key for HT_OTHER_KEY_DOWN and
+// HT_OTHER_KEY_UP, and -1 otherwise. decided_at is the timestamp of the deciding event, or the end
+// of the tapping term for HT_TIMER_EVENT.
+static void decide_hold_tap(struct active_hold_tap *hold_tap, enum decision_moment decision_moment,
+                            int32_t interrupting_position, int64_t decided_at) {
     if (hold_tap->status != STATUS_UNDECIDED) {
         return;
     }
@@ -458,6 +692,9 @@ static void decide_hold_tap(struct active_hold_tap *hold_tap,
     case FLAVOR_TAP_UNLESS_INTERRUPTED:
         decide_tap_unless_interrupted(hold_tap, decision_moment);
         break;
+    case FLAVOR_ADAPTIVE:
+        decide_adaptive(hold_tap, decision_moment);
+        break;
     }
 
     if (hold_tap->status == STATUS_UNDECIDED) {
@@ -471,6 +708,7 @@ static void decide_hold_tap(struct active_hold_tap *hold_tap,
     LOG_DBG("%d decided %s (%s decision moment %s)", hold_tap->position,
             status_str(hold_tap->status), flavor_str(hold_tap->config->flavor),
             decision_moment_str(decision_moment));
+    record_decision(hold_tap, decision_moment, interrupting_position, decided_at);
     undecided_hold_tap = NULL;
     press_binding(hold_tap);
     release_captured_events();
@@ -490,11 +728,9 @@ static void decide_retro_tap(struct active_hold_tap *hold_tap) {
 }
 
 static void update_hold_status_for_retro_tap(uint32_t ignore_position) {
-    for (int i = 0; i < ZMK_BHV_HOLD_TAP_MAX_HELD; i++) {
+    FOR_EACH_ACTIVE_HOLD_TAP(i) {
         struct active_hold_tap *hold_tap = &active_hold_taps[i];
-        if (hold_tap->position == ignore_position ||
-            hold_tap->position == ZMK_BHV_HOLD_TAP_POSITION_NOT_USED ||
-            hold_tap->config->retro_tap == false) {
+        if (hold_tap->position == ignore_position || hold_tap->config->retro_tap == false) {
             continue;
         }
         if (hold_tap->status == STATUS_HOLD_TIMER) {
@@ -526,15 +762,18 @@ static int on_hold_tap_binding_pressed(struct zmk_behavior_binding *binding,
 
     LOG_DBG("%d new undecided hold_tap", event.position);
     undecided_hold_tap = hold_tap;
+    hold_tap->tapping_term_ms = adaptive_tapping_term_ms(hold_tap);
 
     if (is_quick_tap(hold_tap)) {
-        decide_hold_tap(hold_tap, HT_QUICK_TAP);
+        decide_hold_tap(hold_tap, HT_QUICK_TAP, -1, event.timestamp);
     }
 
     // if this behavior was queued we have to adjust the timer to only
     // wait for the remaining time.
-    int32_t tapping_term_ms_left = (hold_tap->timestamp + cfg->tapping_term_ms) - k_uptime_get();
-    k_work_schedule(&hold_tap->work, K_MSEC(tapping_term_ms_left));
+    int32_t tapping_term_ms_left =
+        (hold_tap->timestamp + hold_tap->tapping_term_ms) - k_uptime_get();
+    k_work_schedule_for_queue(zmk_event_manager_work_q(), &hold_tap->work,
+                              K_MSEC(tapping_term_ms_left));
 
     return ZMK_BEHAVIOR_OPAQUE;
 }
@@ -550,13 +789,15 @@ static int on_hold_tap_binding_released(struct zmk_behavior_binding *binding,
     // If these events were queued, the timer event may be queued too late or not at all.
     // We insert a timer event before the TH_KEY_UP event to verify.
     int work_cancel_result = k_work_cancel_delayable(&hold_tap->work);
-    if (event.timestamp > (hold_tap->timestamp + hold_tap->config->tapping_term_ms)) {
-        decide_hold_tap(hold_tap, HT_TIMER_EVENT);
+    if (event.timestamp > (hold_tap->timestamp + hold_tap->tapping_term_ms)) {
+        decide_hold_tap(hold_tap, HT_TIMER_EVENT, -1,
+                        hold_tap->timestamp + hold_tap->tapping_term_ms);
     }
 
-    decide_hold_tap(hold_tap, HT_KEY_UP);
+    decide_hold_tap(hold_tap, HT_KEY_UP, -1, event.timestamp);
     decide_retro_tap(hold_tap);
     release_binding(hold_tap);
+    update_tap_model(hold_tap, event.timestamp);
 
     if (work_cancel_result == -EINPROGRESS) {
         // let the timer handler clean up
@@ -592,6 +833,7 @@ static int position_state_changed_listener(const zmk_event_t *eh) {
             -1) // i.e. no other key has been pressed yet
     ) {
         undecided_hold_tap->position_of_first_other_key_pressed = ev->position;
+        undecided_hold_tap->timestamp_of_first_other_key_pressed = ev->timestamp;
     }
 
     if (undecided_hold_tap->position == ev->position) {
@@ -608,8 +850,9 @@ static int position_state_changed_listener(const zmk_event_t *eh) {
     // We make a timer decision before the other key events are handled if the timer would
     // have run out.
     if (ev->timestamp >
-        (undecided_hold_tap->timestamp + undecided_hold_tap->config->tapping_term_ms)) {
-        decide_hold_tap(undecided_hold_tap, HT_TIMER_EVENT);
+        (undecided_hold_tap->timestamp + undecided_hold_tap->tapping_term_ms)) {
+        decide_hold_tap(undecided_hold_tap, HT_TIMER_EVENT, -1,
+                        undecided_hold_tap->timestamp + undecided_hold_tap->tapping_term_ms);
     }
 
     if (undecided_hold_tap == NULL) {
@@ -624,10 +867,16 @@ static int position_state_changed_listener(const zmk_event_t *eh) {
         return ZMK_EV_EVENT_BUBBLE;
     }
 
+    if (capture_event(eh) != 0) {
+        LOG_ERR("Unable to capture %d event, increase "
+                "CONFIG_ZMK_BEHAVIORS_HOLD_TAP_MAX_CAPTURED_EVENTS",
+                ev->position);
+        return ZMK_EV_EVENT_BUBBLE;
+    }
     LOG_DBG("%d capturing %d %s event", undecided_hold_tap->position, ev->position,
             ev->state ? "down" : "up");
-    capture_event(eh);
-    decide_hold_tap(undecided_hold_tap, ev->state ? HT_OTHER_KEY_DOWN : HT_OTHER_KEY_UP);
+    decide_hold_tap(undecided_hold_tap, ev->state ? HT_OTHER_KEY_DOWN : HT_OTHER_KEY_UP,
+                    ev->position, ev->timestamp);
     return ZMK_EV_EVENT_CAPTURED;
 }
 
@@ -651,9 +900,14 @@ static int keycode_state_changed_listener(const zmk_event_t *eh) {
 
     // only key-up events will bubble through position_state_changed_listener
     // if a undecided_hold_tap is active.
+    if (capture_event(eh) != 0) {
+        LOG_ERR("Unable to capture 0x%02X event, increase "
+                "CONFIG_ZMK_BEHAVIORS_HOLD_TAP_MAX_CAPTURED_EVENTS",
+                ev->keycode);
+        return ZMK_EV_EVENT_BUBBLE;
+    }
     LOG_DBG("%d capturing 0x%02X %s event", undecided_hold_tap->position, ev->keycode,
             ev->state ? "down" : "up");
-    capture_event(eh);
     return ZMK_EV_EVENT_CAPTURED;
 }
 
@@ -677,7 +931,8 @@ void behavior_hold_tap_timer_work_handler(struct k_work *item) {
     if (hold_tap->work_is_cancelled) {
         clear_hold_tap(hold_tap);
     } else {
-        decide_hold_tap(hold_tap, HT_TIMER_EVENT);
+        decide_hold_tap(hold_tap, HT_TIMER_EVENT, -1,
+                        hold_tap->timestamp + hold_tap->tapping_term_ms);
     }
 }
 
@@ -701,6 +956,7 @@ static int behavior_hold_tap_init(const struct device *dev) {
         .tap_behavior_dev = DT_LABEL(DT_INST_PHANDLE_BY_IDX(n, bindings, 1)),                      \
         .quick_tap_ms = DT_INST_PROP(n, quick_tap_ms),                                             \
         .global_quick_tap = DT_INST_PROP(n, global_quick_tap),                                     \
+        .require_prior_idle_ms = DT_INST_PROP(n, require_prior_idle_ms),                           \
         .flavor = DT_ENUM_IDX(DT_DRV_INST(n), flavor),                                             \
         .retro_tap = DT_INST_PROP(n, retro_tap),                                                   \
         .hold_trigger_key_positions = DT_INST_PROP(n, hold_trigger_key_positions),                 \
@@ -9,8 +9,13 @@
 #include <device.h>
 #include <drivers/behavior.h>
 #include <logging/log.h>
+#include <dt-bindings/zmk/hid_usage_pages.h>
+#include <dt-bindings/zmk/modifiers.h>
 #include <zmk/behavior.h>
 #include <zmk/behavior_queue.h>
+#include <zmk/endpoints.h>
+#include <zmk/hid.h>
+#include <zmk/keys.h>
 #include <zmk/keymap.h>
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
@@ -31,15 +36,38 @@ struct behavior_macro_trigger_state {
     uint16_t count;
 };
 
-struct behavior_macro_state {
-    struct behavior_macro_trigger_state release_state;
+// One step of a compiled macro: a press or release of bindings[index], or, if len is not zero, a
+// fast text chunk that taps bindings[index] up to bindings[index + len - 1].
+struct macro_op {
+    uint16_t index;
+    uint8_t len;
+    bool press;
+    uint32_t wait_ms;
+};
 
-    uint32_t press_bindings_count;
+// The ops run when the macro is pressed or released, compiled from the bindings and trigger state
+// in state. ops_start is where they start in the ops of the macro, if it stores them.
+struct behavior_macro_program {
+    struct behavior_macro_trigger_state state;
+    uint16_t ops_start;
+    uint16_t ops_count;
+};
+
+struct behavior_macro_state {
+    struct behavior_macro_program press;
+    struct behavior_macro_program release;
 };
 
 struct behavior_macro_config {
     uint32_t default_wait_ms;
     uint32_t default_tap_ms;
+    bool fast_text;
+    bool cancel_on_release;
+    // the compiled ops of fast text macros, whose chunks refer to them. Other macros compile their
+    // ops again each time they are triggered, so they do not need the RAM.
+    struct macro_op *ops;
+    // the internal behavior that sends the fast text chunks of the macro, or NULL.
+    const char *fast_text_dev;
     uint32_t count;
     struct zmk_behavior_binding bindings[];
 };
@@ -52,6 +80,8 @@ struct behavior_macro_config {
 #define WAIT_TIME DT_LABEL(DT_INST(0, zmk_macro_control_wait_time))
 #define WAIT_REL DT_LABEL(DT_INST(0, zmk_macro_pause_for_release))
 
+#define KEY_PRESS DT_LABEL(DT_INST(0, zmk_behavior_key_press))
+
 #define ZM_IS_NODE_MATCH(a, b) (strcmp(a, b) == 0)
 #define IS_TAP_MODE(dev) ZM_IS_NODE_MATCH(dev, TAP_MODE)
 #define IS_PRESS_MODE(dev) ZM_IS_NODE_MATCH(dev, PRESS_MODE)
@@ -61,6 +91,20 @@ struct behavior_macro_config {
 #define IS_WAIT_TIME(dev) ZM_IS_NODE_MATCH(dev, WAIT_TIME)
 #define IS_PAUSE(dev) ZM_IS_NODE_MATCH(dev, WAIT_REL)
 
+#define IS_KEY_PRESS(dev) ZM_IS_NODE_MATCH(dev, KEY_PRESS)
+
+// Keys pressed in the same report reach the host in report order, which is the order of the
+// usages for NKRO reports. Fast text therefore only packs runs of strictly increasing usages.
+// An HKRO report holds CONFIG_ZMK_HID_KEYBOARD_REPORT_SIZE keys, while an NKRO report holds every
+// key, so there a chunk is only limited by the length of an op.
+#if IS_ENABLED(CONFIG_ZMK_HID_REPORT_TYPE_HKRO)
+#define FAST_TEXT_MAX_KEYS MIN(CONFIG_ZMK_HID_KEYBOARD_REPORT_SIZE, UINT8_MAX)
+#elif IS_ENABLED(CONFIG_ZMK_HID_REPORT_TYPE_NKRO)
+#define FAST_TEXT_MAX_KEYS UINT8_MAX
+#else
+#error "Unsupported HID report type for fast text"
+#endif
+
 static bool handle_control_binding(struct behavior_macro_trigger_state *state,
                                    const struct zmk_behavior_binding *binding) {
     if (IS_TAP_MODE(binding->behavior_dev)) {
@@ -85,51 +129,194 @@ static bool handle_control_binding(struct behavior_macro_trigger_state *state,
     return true;
 }
 
+// Returns the keyboard usage of a binding that fast text can send directly, or 0 if it has to go
+// through the behavior. Only plain key presses qualify, since modifiers apply to the whole report.
+static zmk_key_t fast_text_key(const struct zmk_behavior_binding *binding) {
+    uint32_t page = ZMK_HID_USAGE_PAGE(binding->param1);
+    zmk_key_t key = ZMK_HID_USAGE_ID(binding->param1);
+
+    if (!IS_KEY_PRESS(binding->behavior_dev) || SELECT_MODS(binding->param1) != 0 ||
+        (page != 0 && page != HID_USAGE_KEY) || is_mod(HID_USAGE_KEY, key)) {
+        return 0;
+    }
+    return key;
+}
+
+// Returns the number of bindings starting at bindings[i] that can be sent as one fast text chunk.
+static uint8_t fast_text_chunk_len(const struct behavior_macro_config *cfg, int i, int end) {
+    uint8_t len = 0;
+    zmk_key_t last = 0;
+
+    for (; i < end && len < FAST_TEXT_MAX_KEYS; i++, len++) {
+        zmk_key_t key = fast_text_key(&cfg->bindings[i]);
+        if (key == 0 || key <= last) {
+            break;
+        }
+        last = key;
+    }
+    return len;
+}
+
+static void add_op(const struct behavior_macro_config *cfg, struct behavior_macro_program *program,
+                   const struct zmk_behavior_binding_event *event, struct macro_op op) {
+    if (event != NULL) {
+        zmk_behavior_queue_add(event->position, cfg->bindings[op.index], op.press, op.wait_ms);
+    } else if (cfg->ops != NULL) {
+        cfg->ops[program->ops_start + program->ops_count] = op;
+    }
+    program->ops_count++;
+}
+
+// Resolves the control bindings and timings of the program's bindings into ops and counts them.
+// At init, event is NULL and the ops are stored if the macro keeps them, so running it is a walk
+// over the stored ops. Otherwise the ops are queued for the event's position right away.
+static void compile_program(const struct behavior_macro_config *cfg,
+                            struct behavior_macro_program *program,
+                            const struct zmk_behavior_binding_event *event) {
+    struct behavior_macro_trigger_state state = program->state;
+    int end = state.start_index + state.count;
+
+    program->ops_count = 0;
+
+    for (int i = state.start_index; i < end; i++) {
+        const struct zmk_behavior_binding *binding = &cfg->bindings[i];
+        if (handle_control_binding(&state, binding)) {
+            continue;
+        }
+
+        switch (state.mode) {
+        case MACRO_MODE_TAP: {
+            uint8_t len = cfg->fast_text ? fast_text_chunk_len(cfg, i, end) : 0;
+            if (len > 0) {
+                add_op(cfg, program, event,
+                       (struct macro_op){.index = i, .len = len, .press = true});
+                i += len - 1;
+                break;
+            }
+            add_op(cfg, program, event,
+                   (struct macro_op){.index = i, .press = true, .wait_ms = state.tap_ms});
+            add_op(cfg, program, event,
+                   (struct macro_op){.index = i, .press = false, .wait_ms = state.wait_ms});
+            break;
+        }
+        case MACRO_MODE_PRESS:
+            add_op(cfg, program, event,
+                   (struct macro_op){.index = i, .press = true, .wait_ms = state.wait_ms});
+            break;
+        case MACRO_MODE_RELEASE:
+            add_op(cfg, program, event,
+                   (struct macro_op){.index = i, .press = false, .wait_ms = state.wait_ms});
+            break;
+        default:
+            LOG_ERR("Unknown macro mode: %d", state.mode);
+            break;
+        }
+    }
+}
+
 static int behavior_macro_init(const struct device *dev) {
     const struct behavior_macro_config *cfg = dev->config;
     struct behavior_macro_state *state = dev->data;
-    state->press_bindings_count = cfg->count;
-    state->release_state.start_index = cfg->count;
-    state->release_state.count = 0;
+    struct behavior_macro_trigger_state press_state = {.mode = MACRO_MODE_TAP,
+                                                       .tap_ms = cfg->default_tap_ms,
+                                                       .wait_ms = cfg->default_wait_ms,
+                                                       .start_index = 0,
+                                                       .count = cfg->count};
+    struct behavior_macro_trigger_state release_state = {.start_index = cfg->count, .count = 0};
 
     LOG_DBG("Precalculate initial release state:");
     for (int i = 0; i < cfg->count; i++) {
-        if (handle_control_binding(&state->release_state, &cfg->bindings[i])) {
+        if (handle_control_binding(&release_state, &cfg->bindings[i])) {
             // Updated state used for initial state on release.
         } else if (IS_PAUSE(cfg->bindings[i].behavior_dev)) {
-            state->release_state.start_index = i + 1;
-            state->release_state.count = cfg->count - state->release_state.start_index;
-            state->press_bindings_count = i;
-            LOG_DBG("Release will resume at %d", state->release_state.start_index);
+            release_state.start_index = i + 1;
+            release_state.count = cfg->count - release_state.start_index;
+            press_state.count = i;
+            LOG_DBG("Release will resume at %d", release_state.start_index);
             break;
         } else {
             // Ignore regular invokable bindings
         }
     }
 
+    state->press = (struct behavior_macro_program){.state = press_state, .ops_start = 0};
+    compile_program(cfg, &state->press, NULL);
+    state->release = (struct behavior_macro_program){.state = release_state,
+                                                     .ops_start = state->press.ops_count};
+    compile_program(cfg, &state->release, NULL);
+
     return 0;
 };
 
-static void queue_macro(uint32_t position, const struct zmk_behavior_binding bindings[],
-                        struct behavior_macro_trigger_state state) {
-    LOG_DBG("Iterating macro bindings - starting: %d, count: %d", state.start_index, state.count);
-    for (int i = state.start_index; i < state.start_index + state.count; i++) {
-        if (!handle_control_binding(&state, &bindings[i])) {
-            switch (state.mode) {
-            case MACRO_MODE_TAP:
-                zmk_behavior_queue_add(position, bindings[i], true, state.tap_ms);
-                zmk_behavior_queue_add(position, bindings[i], false, state.wait_ms);
-                break;
-            case MACRO_MODE_PRESS:
-                zmk_behavior_queue_add(position, bindings[i], true, state.wait_ms);
-                break;
-            case MACRO_MODE_RELEASE:
-                zmk_behavior_queue_add(position, bindings[i], false, state.wait_ms);
+// Taps the keys of a fast text chunk, pressing as many of them as fit in one report before
+// releasing them all in the next one.
+static void send_fast_text(const struct zmk_behavior_binding *bindings, uint8_t len) {
+    int start = 0;
+
+    while (start < len) {
+        int end = start;
+        for (; end < len; end++) {
+            zmk_key_t key = ZMK_HID_USAGE_ID(bindings[end].param1);
+            if (zmk_hid_keyboard_is_pressed(key)) {
                 break;
-            default:
-                LOG_ERR("Unknown macro mode: %d", state.mode);
+            }
+            zmk_hid_keyboard_press(key);
+            if (!zmk_hid_keyboard_is_pressed(key)) {
+                // the report is full.
                 break;
             }
+            LOG_DBG("pressed 0x%02X", key);
+        }
+
+        if (end == start) {
+            LOG_WRN("Unable to send 0x%02X, the key is held or the report is full",
+                    ZMK_HID_USAGE_ID(bindings[start].param1));
+            start++;
+            continue;
+        }
+
+        LOG_DBG("sending chunk of %d starting with 0x%02X", end - start,
+                ZMK_HID_USAGE_ID(bindings[start].param1));
+        zmk_endpoints_send_report(HID_USAGE_KEY);
+        for (int i = start; i < end; i++) {
+            zmk_key_t key = ZMK_HID_USAGE_ID(bindings[i].param1);
+            zmk_hid_keyboard_release(key);
+            LOG_DBG("released 0x%02X", key);
+        }
+        LOG_DBG("releasing chunk of %d", end - start);
+        zmk_endpoints_send_report(HID_USAGE_KEY);
+        start = end;
+    }
+}
+
+static void queue_macro(const struct zmk_behavior_binding_event *event,
+                        const struct behavior_macro_config *cfg,
+                        const struct behavior_macro_program *program) {
+    LOG_DBG("Iterating macro bindings - starting: %d, count: %d", program->state.start_index,
+            program->state.count);
+    // queue all of the ops or none of them, so a macro never stops halfway with keys held.
+    if (zmk_behavior_queue_available() < program->ops_count) {
+        LOG_ERR("Behavior queue is too full for %d macro steps, increase "
+                "CONFIG_ZMK_BEHAVIORS_QUEUE_SIZE",
+                program->ops_count);
+        return;
+    }
+    if (cfg->ops == NULL) {
+        struct behavior_macro_program queued = *program;
+        compile_program(cfg, &queued, event);
+        return;
+    }
+    for (int i = program->ops_start; i < program->ops_start + program->ops_count; i++) {
+        const struct macro_op *op = &cfg->ops[i];
+        if (op->len > 0) {
+            // fast text chunks are queued as a press of the macro's fast text behavior, so they
+            // run in order with the other queued behaviors. param1 is the index of the op.
+            struct zmk_behavior_binding chunk = {.behavior_dev = (char *)cfg->fast_text_dev,
+                                                 .param1 = i};
+            zmk_behavior_queue_add(event->position, chunk, true, op->wait_ms);
+        } else {
+            zmk_behavior_queue_add(event->position, cfg->bindings[op->index], op->press,
+                                   op->wait_ms);
         }
     }
 }
@@ -139,13 +326,8 @@ static int on_macro_binding_pressed(struct zmk_behavior_binding *binding,
     const struct device *dev = device_get_binding(binding->behavior_dev);
     const struct behavior_macro_config *cfg = dev->config;
     struct behavior_macro_state *state = dev->data;
-    struct behavior_macro_trigger_state trigger_state = {.mode = MACRO_MODE_TAP,
-                                                         .tap_ms = cfg->default_tap_ms,
-                                                         .wait_ms = cfg->default_wait_ms,
-                                                         .start_index = 0,
-                                                         .count = state->press_bindings_count};
 
-    queue_macro(event.position, cfg->bindings, trigger_state);
+    queue_macro(&event, cfg, &state->press);
 
     return ZMK_BEHAVIOR_OPAQUE;
 }
@@ -156,7 +338,12 @@ static int on_macro_binding_released(struct zmk_behavior_binding *binding,
     const struct behavior_macro_config *cfg = dev->config;
     struct behavior_macro_state *state = dev->data;
 
-    queue_macro(event.position, cfg->bindings, state->release_state);
+    if (cfg->cancel_on_release) {
+        // drop whatever the press has not run yet, releasing anything it left held.
+        zmk_behavior_queue_cancel(event.position);
+    }
+
+    queue_macro(&event, cfg, &state->release);
 
     return ZMK_BEHAVIOR_OPAQUE;
 }
@@ -166,21 +353,58 @@ static const struct behavior_driver_api behavior_macro_driver_api = {
     .binding_released = on_macro_binding_released,
 };
 
+static int behavior_macro_fast_text_init(const struct device *dev) { return 0; }
+
+// The fast text behavior of a macro shares the macro's config. Its chunks are only ever pressed,
+// by the behavior queue, with param1 set to the index of the chunk's op.
+static int on_fast_text_binding_pressed(struct zmk_behavior_binding *binding,
+                                        struct zmk_behavior_binding_event event) {
+    const struct device *dev = device_get_binding(binding->behavior_dev);
+    const struct behavior_macro_config *cfg = dev->config;
+    const struct macro_op *op = &cfg->ops[binding->param1];
+
+    send_fast_text(&cfg->bindings[op->index], op->len);
+
+    return ZMK_BEHAVIOR_OPAQUE;
+}
+
+static const struct behavior_driver_api behavior_macro_fast_text_driver_api = {
+    .binding_pressed = on_fast_text_binding_pressed,
+};
+
 #define BINDING_WITH_COMMA(idx, drv_inst) ZMK_KEYMAP_EXTRACT_BINDING(idx, DT_DRV_INST(drv_inst)),
 
 #define TRANSFORMED_BEHAVIORS(n)                                                                   \
     {UTIL_LISTIFY(DT_PROP_LEN(DT_DRV_INST(n), bindings), BINDING_WITH_COMMA, n)},
 
+#define FAST_TEXT_DEV_LABEL(n) DT_INST_LABEL(n) "_FAST_TEXT"
+
+#define FAST_TEXT_INST(n)                                                                          \
+    DEVICE_DEFINE(behavior_macro_fast_text_##n, FAST_TEXT_DEV_LABEL(n),                            \
+                  behavior_macro_fast_text_init, NULL, NULL, &behavior_macro_config_##n,           \
+                  APPLICATION, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT,                                \
+                  &behavior_macro_fast_text_driver_api);
+
 #define MACRO_INST(n)                                                                              \
     static struct behavior_macro_state behavior_macro_state_##n = {};                              \
+    COND_CODE_1(DT_INST_PROP(n, fast_text),                                                        \
+                (static struct macro_op                                                            \
+                     behavior_macro_ops_##n[2 * DT_INST_PROP_LEN(n, bindings)];),                  \
+                ())                                                                                \
     static struct behavior_macro_config behavior_macro_config_##n = {                              \
         .default_wait_ms = DT_INST_PROP_OR(n, wait_ms, 100),                                       \
         .default_tap_ms = DT_INST_PROP_OR(n, tap_ms, 100),                                         \
+        .fast_text = DT_INST_PROP(n, fast_text),                                                   \
+        .cancel_on_release = DT_INST_PROP(n, cancel_on_release),                                   \
+        .ops = COND_CODE_1(DT_INST_PROP(n, fast_text), (behavior_macro_ops_##n), (NULL)),          \
+        .fast_text_dev =                                                                           \
+            COND_CODE_1(DT_INST_PROP(n, fast_text), (FAST_TEXT_DEV_LABEL(n)), (NULL)),             \
         .count = DT_INST_PROP_LEN(n, bindings),                                                    \
         .bindings = TRANSFORMED_BEHAVIORS(n)};                                                     \
     DEVICE_DT_INST_DEFINE(n, behavior_macro_init, NULL, &behavior_macro_state_##n,                 \
                           &behavior_macro_config_##n, APPLICATION,                                 \
-                          CONFIG_KERNEL_INIT_PRIORITY_DEFAULT, &behavior_macro_driver_api);
+                          CONFIG_KERNEL_INIT_PRIORITY_DEFAULT, &behavior_macro_driver_api);        \
+    COND_CODE_1(DT_INST_PROP(n, fast_text), (FAST_TEXT_INST(n)), ())
 
 DT_INST_FOREACH_STATUS_OKAY(MACRO_INST)
 
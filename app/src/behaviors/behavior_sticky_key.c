@@ -19,6 +19,7 @@
 #include <zmk/events/modifiers_state_changed.h>
 #include <zmk/hid.h>
 #include <zmk/keymap.h>
+#include <zmk/timer.h>
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
@@ -26,7 +27,7 @@ LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #define ZMK_BHV_STICKY_KEY_MAX_HELD 10
 
-#define ZMK_BHV_STICKY_KEY_POSITION_FREE UINT32_MAX
+#define ZMK_BHV_STICKY_KEY_ALL_MASK BIT_MASK(ZMK_BHV_STICKY_KEY_MAX_HELD)
 
 struct behavior_sticky_key_config {
     uint32_t release_after_ms;
@@ -42,47 +43,53 @@ struct active_sticky_key {
     const struct behavior_sticky_key_config *config;
     // timer data.
     bool timer_started;
-    bool timer_cancelled;
     int64_t release_at;
-    struct k_work_delayable release_timer;
+    struct zmk_timer release_timer;
     // usage page and keycode for the key that is being modified by this sticky key
     uint8_t modified_key_usage_page;
     uint32_t modified_key_keycode;
 };
 
 struct active_sticky_key active_sticky_keys[ZMK_BHV_STICKY_KEY_MAX_HELD] = {};
+// a bit for each entry of active_sticky_keys that is in use, so keycode events only visit the
+// active sticky keys and skip the listener entirely while there are none.
+static uint32_t active_sticky_key_mask = 0;
+// the active sticky keys with a quick release that is due once the key press that triggered it
+// has been handled by the listeners after this one.
+static uint32_t release_pending_mask = 0;
 
 static struct active_sticky_key *store_sticky_key(uint32_t position, uint32_t param1,
                                                   uint32_t param2,
                                                   const struct behavior_sticky_key_config *config) {
-    for (int i = 0; i < ZMK_BHV_STICKY_KEY_MAX_HELD; i++) {
-        struct active_sticky_key *const sticky_key = &active_sticky_keys[i];
-        if (sticky_key->position != ZMK_BHV_STICKY_KEY_POSITION_FREE ||
-            sticky_key->timer_cancelled) {
-            continue;
-        }
-        sticky_key->position = position;
-        sticky_key->param1 = param1;
-        sticky_key->param2 = param2;
-        sticky_key->config = config;
-        sticky_key->release_at = 0;
-        sticky_key->timer_cancelled = false;
-        sticky_key->timer_started = false;
-        sticky_key->modified_key_usage_page = 0;
-        sticky_key->modified_key_keycode = 0;
-        return sticky_key;
+    uint32_t free_mask = ~active_sticky_key_mask & ZMK_BHV_STICKY_KEY_ALL_MASK;
+    if (free_mask == 0) {
+        return NULL;
     }
-    return NULL;
+    int index = find_lsb_set(free_mask) - 1;
+    struct active_sticky_key *const sticky_key = &active_sticky_keys[index];
+    sticky_key->position = position;
+    sticky_key->param1 = param1;
+    sticky_key->param2 = param2;
+    sticky_key->config = config;
+    sticky_key->release_at = 0;
+    sticky_key->timer_started = false;
+    sticky_key->modified_key_usage_page = 0;
+    sticky_key->modified_key_keycode = 0;
+    active_sticky_key_mask |= BIT(index);
+    return sticky_key;
 }
 
 static void clear_sticky_key(struct active_sticky_key *sticky_key) {
-    sticky_key->position = ZMK_BHV_STICKY_KEY_POSITION_FREE;
+    zmk_timer_cancel(&sticky_key->release_timer);
+    active_sticky_key_mask &= ~BIT(sticky_key - active_sticky_keys);
+    release_pending_mask &= ~BIT(sticky_key - active_sticky_keys);
 }
 
 static struct active_sticky_key *find_sticky_key(uint32_t position) {
-    for (int i = 0; i < ZMK_BHV_STICKY_KEY_MAX_HELD; i++) {
-        if (active_sticky_keys[i].position == position && !active_sticky_keys[i].timer_cancelled) {
-            return &active_sticky_keys[i];
+    for (uint32_t mask = active_sticky_key_mask; mask != 0; mask &= mask - 1) {
+        struct active_sticky_key *sticky_key = &active_sticky_keys[find_lsb_set(mask) - 1];
+        if (sticky_key->position == position) {
+            return sticky_key;
         }
     }
     return NULL;
@@ -118,13 +125,16 @@ static inline int release_sticky_key_behavior(struct active_sticky_key *sticky_k
     return behavior_keymap_binding_released(&binding, event);
 }
 
-static int stop_timer(struct active_sticky_key *sticky_key) {
-    int timer_cancel_result = k_work_cancel_delayable(&sticky_key->release_timer);
-    if (timer_cancel_result == -EINPROGRESS) {
-        // too late to cancel, we'll let the timer handler clear up.
-        sticky_key->timer_cancelled = true;
+static void stop_timer(struct active_sticky_key *sticky_key) {
+    zmk_timer_cancel(&sticky_key->release_timer);
+}
+
+// releases the sticky keys in mask that still have a quick release pending, in slot order.
+static void release_pending_sticky_keys(uint32_t mask) {
+    while ((mask &= release_pending_mask) != 0) {
+        struct active_sticky_key *sticky_key = &active_sticky_keys[find_lsb_set(mask) - 1];
+        release_sticky_key_behavior(sticky_key, sticky_key->release_at);
     }
-    return timer_cancel_result;
 }
 
 static int on_sticky_key_binding_pressed(struct zmk_behavior_binding *binding,
@@ -165,11 +175,9 @@ static int on_sticky_key_binding_released(struct zmk_behavior_binding *binding,
     // No other key was pressed. Start the timer.
     sticky_key->timer_started = true;
     sticky_key->release_at = event.timestamp + sticky_key->config->release_after_ms;
-    // adjust timer in case this behavior was queued by a hold-tap
-    int32_t ms_left = sticky_key->release_at - k_uptime_get();
-    if (ms_left > 0) {
-        k_work_schedule(&sticky_key->release_timer, K_MSEC(ms_left));
-    }
+    // a release_at that has already passed, e.g. because this behavior was queued by a hold-tap,
+    // expires right away.
+    zmk_timer_start(&sticky_key->release_timer, sticky_key->release_at);
     return ZMK_BEHAVIOR_OPAQUE;
 }
 
@@ -184,18 +192,23 @@ ZMK_LISTENER(behavior_sticky_key, sticky_key_keycode_state_changed_listener);
 ZMK_SUBSCRIPTION(behavior_sticky_key, zmk_keycode_state_changed);
 
 static int sticky_key_keycode_state_changed_listener(const zmk_event_t *eh) {
+    if (active_sticky_key_mask == 0) {
+        return ZMK_EV_EVENT_BUBBLE;
+    }
     struct zmk_keycode_state_changed *ev = as_zmk_keycode_state_changed(eh);
     if (ev == NULL) {
         return ZMK_EV_EVENT_BUBBLE;
     }
 
-    // keep track whether the event has been reraised, so we only reraise it once
-    bool event_reraised = false;
-    for (int i = 0; i < ZMK_BHV_STICKY_KEY_MAX_HELD; i++) {
-        struct active_sticky_key *sticky_key = &active_sticky_keys[i];
-        if (sticky_key->position == ZMK_BHV_STICKY_KEY_POSITION_FREE) {
+    // the sticky keys this event triggers a quick release for.
+    uint32_t quick_release_mask = 0;
+    for (uint32_t mask = active_sticky_key_mask; mask != 0; mask &= mask - 1) {
+        int index = find_lsb_set(mask) - 1;
+        // sticky keys released by an earlier iteration, or still waiting for their quick release.
+        if (!(active_sticky_key_mask & BIT(index)) || (release_pending_mask & BIT(index))) {
             continue;
         }
+        struct active_sticky_key *sticky_key = &active_sticky_keys[index];
 
         if (strcmp(sticky_key->config->behavior.behavior_dev, "KEY_PRESS") == 0 &&
             ZMK_HID_USAGE_ID(sticky_key->param1) == ev->keycode &&
@@ -226,12 +239,10 @@ static int sticky_key_keycode_state_changed_listener(const zmk_event_t *eh) {
             if (sticky_key->timer_started) {
                 stop_timer(sticky_key);
                 if (sticky_key->config->quick_release) {
-                    // immediately release the sticky key after the key press is handled.
-                    if (!event_reraised) {
-                        ZMK_EVENT_RAISE_AFTER(eh, behavior_sticky_key);
-                        event_reraised = true;
-                    }
-                    release_sticky_key_behavior(sticky_key, ev->timestamp);
+                    // release the sticky key once the key press has been handled.
+                    release_pending_mask |= BIT(index);
+                    quick_release_mask |= BIT(index);
+                    sticky_key->release_at = ev->timestamp;
                 }
             }
             sticky_key->modified_key_usage_page = ev->usage_page;
@@ -245,32 +256,35 @@ static int sticky_key_keycode_state_changed_listener(const zmk_event_t *eh) {
             }
         }
     }
-    if (event_reraised) {
+
+    if (quick_release_mask != 0) {
+        // hand the key press to the listeners after this one before releasing the sticky keys, so
+        // the host sees the key modified by them and the next key is not. This is the only case
+        // that re-raises, and it only continues after this listener. Folding a sticky modifier
+        // into the key's implicit modifiers instead would release the modifier before the key is
+        // pressed, which changes the reports, and could not cover &sl or non-modifier keys.
+        ZMK_EVENT_RAISE_AFTER(eh, behavior_sticky_key);
+        release_pending_sticky_keys(quick_release_mask);
         return ZMK_EV_EVENT_CAPTURED;
     }
     return ZMK_EV_EVENT_BUBBLE;
 }
 
-void behavior_sticky_key_timer_handler(struct k_work *item) {
+void behavior_sticky_key_timer_handler(struct zmk_timer *timer) {
     struct active_sticky_key *sticky_key =
-        CONTAINER_OF(item, struct active_sticky_key, release_timer);
-    if (sticky_key->position == ZMK_BHV_STICKY_KEY_POSITION_FREE) {
+        CONTAINER_OF(timer, struct active_sticky_key, release_timer);
+    // the handler may already be running when the sticky key is cleared from another thread.
+    if (!(active_sticky_key_mask & BIT(sticky_key - active_sticky_keys))) {
         return;
     }
-    if (sticky_key->timer_cancelled) {
-        sticky_key->timer_cancelled = false;
-    } else {
-        release_sticky_key_behavior(sticky_key, sticky_key->release_at);
-    }
+    release_sticky_key_behavior(sticky_key, sticky_key->release_at);
 }
 
 static int behavior_sticky_key_init(const struct device *dev) {
     static bool init_first_run = true;
     if (init_first_run) {
         for (int i = 0; i < ZMK_BHV_STICKY_KEY_MAX_HELD; i++) {
-            k_work_init_delayable(&active_sticky_keys[i].release_timer,
-                                  behavior_sticky_key_timer_handler);
-            active_sticky_keys[i].position = ZMK_BHV_STICKY_KEY_POSITION_FREE;
+            zmk_timer_init(&active_sticky_keys[i].release_timer, behavior_sticky_key_timer_handler);
         }
     }
     init_first_run = false;
@@ -16,14 +16,15 @@
 #include <zmk/events/position_state_changed.h>
 #include <zmk/events/keycode_state_changed.h>
 #include <zmk/hid.h>
+#include <zmk/timer.h>
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #if DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT)
 
-#define ZMK_BHV_TAP_DANCE_MAX_HELD 10
+#define ZMK_BHV_TAP_DANCE_MAX_HELD CONFIG_ZMK_BEHAVIORS_TAP_DANCE_MAX_HELD
 
-#define ZMK_BHV_TAP_DANCE_POSITION_FREE UINT32_MAX
+#define ZMK_BHV_TAP_DANCE_ALL_MASK (UINT32_MAX >> (32 - ZMK_BHV_TAP_DANCE_MAX_HELD))
 
 struct behavior_tap_dance_config {
     uint32_t tapping_term_ms;
@@ -41,19 +42,21 @@ struct active_tap_dance {
     const struct behavior_tap_dance_config *config;
 
     // Timer Data
-    bool timer_started;
-    bool timer_cancelled;
     bool tap_dance_decided;
     int64_t release_at;
-    struct k_work_delayable release_timer;
+    struct zmk_timer release_timer;
 };
 
 struct active_tap_dance active_tap_dances[ZMK_BHV_TAP_DANCE_MAX_HELD] = {};
+// a bit for each entry of active_tap_dances that is in use. Lookups only visit the active entries,
+// and key presses skip the listener entirely while no tap dance is active.
+static uint32_t active_tap_dance_mask = 0;
 
 static struct active_tap_dance *find_tap_dance(uint32_t position) {
-    for (int i = 0; i < ZMK_BHV_TAP_DANCE_MAX_HELD; i++) {
-        if (active_tap_dances[i].position == position && !active_tap_dances[i].timer_cancelled) {
-            return &active_tap_dances[i];
+    for (uint32_t mask = active_tap_dance_mask; mask != 0; mask &= mask - 1) {
+        struct active_tap_dance *tap_dance = &active_tap_dances[find_lsb_set(mask) - 1];
+        if (tap_dance->position == position) {
+            return tap_dance;
         }
     }
     return NULL;
@@ -61,45 +64,38 @@ static struct active_tap_dance *find_tap_dance(uint32_t position) {
 
 static int new_tap_dance(uint32_t position, const struct behavior_tap_dance_config *config,
                          struct active_tap_dance **tap_dance) {
-    for (int i = 0; i < ZMK_BHV_TAP_DANCE_MAX_HELD; i++) {
-        struct active_tap_dance *const ref_dance = &active_tap_dances[i];
-        if (ref_dance->position == ZMK_BHV_TAP_DANCE_POSITION_FREE) {
-            ref_dance->counter = 0;
-            ref_dance->position = position;
-            ref_dance->config = config;
-            ref_dance->release_at = 0;
-            ref_dance->is_pressed = true;
-            ref_dance->timer_started = true;
-            ref_dance->timer_cancelled = false;
-            ref_dance->tap_dance_decided = false;
-            *tap_dance = ref_dance;
-            return 0;
-        }
-    }
-    return -ENOMEM;
+    uint32_t free_mask = ~active_tap_dance_mask & ZMK_BHV_TAP_DANCE_ALL_MASK;
+    if (free_mask == 0) {
+        return -ENOMEM;
+    }
+    int index = find_lsb_set(free_mask) - 1;
+    struct active_tap_dance *const ref_dance = &active_tap_dances[index];
+    ref_dance->counter = 0;
+    ref_dance->position = position;
+    ref_dance->config = config;
+    ref_dance->release_at = 0;
+    ref_dance->is_pressed = true;
+    ref_dance->tap_dance_decided = false;
+    active_tap_dance_mask |= BIT(index);
+    *tap_dance = ref_dance;
+    return 0;
 }
 
 static void clear_tap_dance(struct active_tap_dance *tap_dance) {
-    tap_dance->position = ZMK_BHV_TAP_DANCE_POSITION_FREE;
+    zmk_timer_cancel(&tap_dance->release_timer);
+    active_tap_dance_mask &= ~BIT(tap_dance - active_tap_dances);
 }
 
-static int stop_timer(struct active_tap_dance *tap_dance) {
-    int timer_cancel_result = k_work_cancel_delayable(&tap_dance->release_timer);
-    if (timer_cancel_result == -EINPROGRESS) {
-        // too late to cancel, we'll let the timer handler clear up.
-        tap_dance->timer_cancelled = true;
-    }
-    return timer_cancel_result;
+static void stop_timer(struct active_tap_dance *tap_dance) {
+    zmk_timer_cancel(&tap_dance->release_timer);
 }
 
 static void reset_timer(struct active_tap_dance *tap_dance,
                         struct zmk_behavior_binding_event event) {
     tap_dance->release_at = event.timestamp + tap_dance->config->tapping_term_ms;
-    int32_t ms_left = tap_dance->release_at - k_uptime_get();
-    if (ms_left > 0) {
-        k_work_schedule(&tap_dance->release_timer, K_MSEC(ms_left));
-        LOG_DBG("Successfully reset timer at position %d", tap_dance->position);
-    }
+    // a release_at that has already passed expires right away.
+    zmk_timer_start(&tap_dance->release_timer, tap_dance->release_at);
+    LOG_DBG("Successfully reset timer at position %d", tap_dance->position);
 }
 
 static inline int press_tap_dance_behavior(struct active_tap_dance *tap_dance, int64_t timestamp) {
@@ -131,7 +127,8 @@ static int on_tap_dance_binding_pressed(struct zmk_behavior_binding *binding,
     tap_dance = find_tap_dance(event.position);
     if (tap_dance == NULL) {
         if (new_tap_dance(event.position, cfg, &tap_dance) == -ENOMEM) {
-            LOG_ERR("Unable to create new tap dance. Insufficient space in active_tap_dances[].");
+            LOG_ERR("Unable to create new tap dance. Insufficient space in active_tap_dances[], "
+                    "increase CONFIG_ZMK_BEHAVIORS_TAP_DANCE_MAX_HELD.");
             return ZMK_BEHAVIOR_OPAQUE;
         }
         LOG_DBG("%d created new tap dance", event.position);
@@ -168,12 +165,11 @@ static int on_tap_dance_binding_released(struct zmk_behavior_binding *binding,
     return ZMK_BEHAVIOR_OPAQUE;
 }
 
-void behavior_tap_dance_timer_handler(struct k_work *item) {
-    struct active_tap_dance *tap_dance = CONTAINER_OF(item, struct active_tap_dance, release_timer);
-    if (tap_dance->position == ZMK_BHV_TAP_DANCE_POSITION_FREE) {
-        return;
-    }
-    if (tap_dance->timer_cancelled) {
+void behavior_tap_dance_timer_handler(struct zmk_timer *timer) {
+    struct active_tap_dance *tap_dance =
+        CONTAINER_OF(timer, struct active_tap_dance, release_timer);
+    // the handler may already be running when the tap dance is cleared from another thread.
+    if (!(active_tap_dance_mask & BIT(tap_dance - active_tap_dances))) {
         return;
     }
     LOG_DBG("Tap dance has been decided via timer. Counter reached: %d", tap_dance->counter);
@@ -195,6 +191,9 @@ ZMK_LISTENER(behavior_tap_dance, tap_dance_position_state_changed_listener);
 ZMK_SUBSCRIPTION(behavior_tap_dance, zmk_position_state_changed);
 
 static int tap_dance_position_state_changed_listener(const zmk_event_t *eh) {
+    if (active_tap_dance_mask == 0) {
+        return ZMK_EV_EVENT_BUBBLE;
+    }
     struct zmk_position_state_changed *ev = as_zmk_position_state_changed(eh);
     if (ev == NULL) {
         return ZMK_EV_EVENT_BUBBLE;
@@ -203,11 +202,8 @@ static int tap_dance_position_state_changed_listener(const zmk_event_t *eh) {
         LOG_DBG("Ignore upstroke at position %d.", ev->position);
         return ZMK_EV_EVENT_BUBBLE;
     }
-    for (int i = 0; i < ZMK_BHV_TAP_DANCE_MAX_HELD; i++) {
-        struct active_tap_dance *tap_dance = &active_tap_dances[i];
-        if (tap_dance->position == ZMK_BHV_TAP_DANCE_POSITION_FREE) {
-            continue;
-        }
+    for (uint32_t mask = active_tap_dance_mask; mask != 0; mask &= mask - 1) {
+        struct active_tap_dance *tap_dance = &active_tap_dances[find_lsb_set(mask) - 1];
         if (tap_dance->position == ev->position) {
             continue;
         }
@@ -228,9 +224,7 @@ static int behavior_tap_dance_init(const struct device *dev) {
     static bool init_first_run = true;
     if (init_first_run) {
         for (int i = 0; i < ZMK_BHV_TAP_DANCE_MAX_HELD; i++) {
-            k_work_init_delayable(&active_tap_dances[i].release_timer,
-                                  behavior_tap_dance_timer_handler);
-            clear_tap_dance(&active_tap_dances[i]);
+            zmk_timer_init(&active_tap_dances[i].release_timer, behavior_tap_dance_timer_handler);
         }
     }
     init_first_run = false;
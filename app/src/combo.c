@@ -18,13 +18,34 @@
 #include <zmk/hid.h>
 #include <zmk/matrix.h>
 #include <zmk/keymap.h>
+#include <zmk/timer.h>
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
 #if DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT)
 
+#define COMBO_ONE(n) +1
+#define COMBO_KEYS_LEN(n) +DT_PROP_LEN(n, key_positions)
+#define COMBO_KEYS_MEMBER(n) uint8_t combo_##n[DT_PROP_LEN(n, key_positions)];
+
+// the sizes of all combo tables are derived from the devicetree, so they are exactly as large as
+// the configured combos need.
+#define NUM_COMBOS (0 DT_INST_FOREACH_CHILD(0, COMBO_ONE))
+#define NUM_COMBO_KEYS (0 DT_INST_FOREACH_CHILD(0, COMBO_KEYS_LEN))
+// a union with one member per combo is as large as the combo with the most keys.
+union combo_keys_max {
+    DT_INST_FOREACH_CHILD(0, COMBO_KEYS_MEMBER)
+};
+#define COMBO_MAX_KEYS sizeof(union combo_keys_max)
+// every active combo holds at least one pressed key, and a combo can only be active once.
+#define COMBO_MAX_ACTIVE MIN(NUM_COMBOS, ZMK_KEYMAP_LEN)
+#define COMBO_SET_WORDS DIV_ROUND_UP(NUM_COMBOS, 32)
+#define POSITION_SET_WORDS DIV_ROUND_UP(ZMK_KEYMAP_LEN, 32)
+
+BUILD_ASSERT(NUM_COMBO_KEYS <= UINT16_MAX, "Too many combo key positions");
+
 struct combo_cfg {
-    int32_t key_positions[CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO];
+    const int32_t *key_positions;
     int32_t key_position_len;
     struct zmk_behavior_binding behavior;
     int32_t timeout_ms;
@@ -34,6 +55,8 @@ struct combo_cfg {
     // the virtual key position is a key position outside the range used by the keyboard.
     // it is necessary so hold-taps can uniquely identify a behavior.
     int32_t virtual_key_position;
+    // the key positions of the combo as a bitmask, filled in from key_positions at init.
+    uint32_t position_mask[POSITION_SET_WORDS];
     int32_t layers_len;
     int8_t layers[];
 };
@@ -43,225 +66,247 @@ struct active_combo {
     // key_positions_pressed is filled with key_positions when the combo is pressed.
     // The keys are removed from this array when they are released.
     // Once this array is empty, the behavior is released.
-    const zmk_event_t *key_positions_pressed[CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO];
+    const zmk_event_t *key_positions_pressed[COMBO_MAX_KEYS];
 };
 
-struct combo_candidate {
-    struct combo_cfg *combo;
-    // the time after which this behavior should be removed from candidates.
-    // by keeping track of when the candidate should be cleared there is no
-    // possibility of accidental releases.
-    int64_t timeout_at;
-};
+#define COMBO_INST(n)                                                                              \
+    static const int32_t combo_key_positions_##n[] = DT_PROP(n, key_positions);                    \
+    static struct combo_cfg combo_config_##n = {                                                   \
+        .timeout_ms = DT_PROP(n, timeout_ms),                                                      \
+        .key_positions = combo_key_positions_##n,                                                  \
+        .key_position_len = DT_PROP_LEN(n, key_positions),                                         \
+        .behavior = ZMK_KEYMAP_EXTRACT_BINDING(0, n),                                              \
+        .virtual_key_position = ZMK_KEYMAP_LEN + __COUNTER__,                                      \
+        .slow_release = DT_PROP(n, slow_release),                                                  \
+        .layers = DT_PROP(n, layers),                                                              \
+        .layers_len = DT_PROP_LEN(n, layers),                                                      \
+    };
+
+#define COMBO_REF(n) &combo_config_##n,
+
+DT_INST_FOREACH_CHILD(0, COMBO_INST)
 
-// set of keys pressed
-const zmk_event_t *pressed_keys[CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO] = {NULL};
+// all combos, sorted shortest-first, then by virtual-key-position at init. Sets of combos are
+// bitmasks indexed into this array, so the lowest set bit is always the preferred combo.
+struct combo_cfg *combos[NUM_COMBOS] = {DT_INST_FOREACH_CHILD(0, COMBO_REF)};
+// the set of combos that may be triggered on each layer
+uint32_t layer_combos[ZMK_KEYMAP_LAYERS_LEN][COMBO_SET_WORDS];
+// a lookup dict that maps a key position to the combos on that position. The combos on position p
+// are combo_lookup[combo_lookup_offsets[p]] up to combo_lookup[combo_lookup_offsets[p + 1]].
+uint16_t combo_lookup_offsets[ZMK_KEYMAP_LEN + 1];
+uint16_t combo_lookup[NUM_COMBO_KEYS];
+
+// the captured key presses, in the order they were pressed
+struct zmk_event_capture pressed_keys = {};
+// the key positions of pressed_keys as a bitmask
+uint32_t pressed_positions[POSITION_SET_WORDS];
 // the set of candidate combos based on the currently pressed_keys
-struct combo_candidate candidates[CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY];
+uint32_t candidates[COMBO_SET_WORDS];
+// the time the first of pressed_keys was pressed. Each candidate is removed from candidates once
+// its timeout has passed since then.
+int64_t candidates_pressed_at;
 // the last candidate that was completely pressed
 struct combo_cfg *fully_pressed_combo = NULL;
-// a lookup dict that maps a key position to all combos on that position
-struct combo_cfg *combo_lookup[ZMK_KEYMAP_LEN][CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY] = {NULL};
 // combos that have been activated and still have (some) keys pressed
 // this array is always contiguous from 0.
-struct active_combo active_combos[CONFIG_ZMK_COMBO_MAX_PRESSED_COMBOS] = {NULL};
+struct active_combo active_combos[COMBO_MAX_ACTIVE] = {NULL};
 int active_combo_count = 0;
 
-struct k_work_delayable timeout_task;
-int64_t timeout_task_timeout_at;
+struct zmk_timer timeout_timer;
+
+// returns the index of the first combo in set at or after start, or -1 if there is none.
+static int next_combo(const uint32_t *set, int start) {
+    for (int word = start / 32; word < COMBO_SET_WORDS; word++) {
+        uint32_t bits = set[word];
+        if (word == start / 32) {
+            bits &= ~BIT_MASK(start % 32);
+        }
+        if (bits != 0) {
+            return word * 32 + find_lsb_set(bits) - 1;
+        }
+    }
+    return -1;
+}
+
+#define FOR_EACH_COMBO(i, set) for (int i = next_combo(set, 0); i >= 0; i = next_combo(set, i + 1))
+
+static int count_combos(const uint32_t *set) {
+    int count = 0;
+    for (int word = 0; word < COMBO_SET_WORDS; word++) {
+        count += __builtin_popcount(set[word]);
+    }
+    return count;
+}
+
+static int initialize_combo(int index) {
+    struct combo_cfg *new_combo = combos[index];
 
-// Store the combo key pointer in the combos array, one pointer for each key position
-// The combos are sorted shortest-first, then by virtual-key-position.
-static int initialize_combo(struct combo_cfg *new_combo) {
     for (int i = 0; i < new_combo->key_position_len; i++) {
         int32_t position = new_combo->key_positions[i];
         if (position >= ZMK_KEYMAP_LEN) {
             LOG_ERR("Unable to initialize combo, key position %d does not exist", position);
             return -EINVAL;
         }
+    }
 
-        struct combo_cfg *insert_combo = new_combo;
-        bool set = false;
-        for (int j = 0; j < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; j++) {
-            struct combo_cfg *combo_at_j = combo_lookup[position][j];
-            if (combo_at_j == NULL) {
-                combo_lookup[position][j] = insert_combo;
-                set = true;
-                break;
-            }
-            if (combo_at_j->key_position_len < insert_combo->key_position_len ||
-                (combo_at_j->key_position_len == insert_combo->key_position_len &&
-                 combo_at_j->virtual_key_position < insert_combo->virtual_key_position)) {
-                continue;
-            }
-            // put insert_combo in this spot, move all other combos up.
-            combo_lookup[position][j] = insert_combo;
-            insert_combo = combo_at_j;
+    for (int i = 0; i < new_combo->key_position_len; i++) {
+        int32_t position = new_combo->key_positions[i];
+        new_combo->position_mask[position / 32] |= BIT(position % 32);
+    }
+
+    for (int layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+        // -1 in the first layer position is global layer scope
+        bool active = new_combo->layers[0] == -1;
+        for (int i = 0; !active && i < new_combo->layers_len; i++) {
+            active = new_combo->layers[i] == layer;
         }
-        if (!set) {
-            LOG_ERR("Too many combos for key position %d, CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY %d.",
-                    position, CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY);
-            return -ENOMEM;
+        if (active) {
+            layer_combos[layer][index / 32] |= BIT(index % 32);
         }
     }
     return 0;
 }
 
-static bool combo_active_on_layer(struct combo_cfg *combo, uint8_t layer) {
-    if (combo->layers[0] == -1) {
-        // -1 in the first layer position is global layer scope
-        return true;
+// Store each combo in the lookup for each of its key positions. Since combos is sorted, the combos
+// on each position are sorted shortest-first, then by virtual-key-position as well.
+static void initialize_combo_lookup() {
+    uint16_t counts[ZMK_KEYMAP_LEN] = {0};
+    for (int i = 0; i < NUM_COMBOS; i++) {
+        for (int j = 0; j < ZMK_KEYMAP_LEN; j++) {
+            if (combos[i]->position_mask[j / 32] & BIT(j % 32)) {
+                counts[j]++;
+            }
+        }
     }
-    for (int j = 0; j < combo->layers_len; j++) {
-        if (combo->layers[j] == layer) {
-            return true;
+
+    combo_lookup_offsets[0] = 0;
+    for (int j = 0; j < ZMK_KEYMAP_LEN; j++) {
+        combo_lookup_offsets[j + 1] = combo_lookup_offsets[j] + counts[j];
+        counts[j] = combo_lookup_offsets[j];
+    }
+
+    for (int i = 0; i < NUM_COMBOS; i++) {
+        for (int j = 0; j < ZMK_KEYMAP_LEN; j++) {
+            if (combos[i]->position_mask[j / 32] & BIT(j % 32)) {
+                combo_lookup[counts[j]++] = i;
+            }
         }
     }
-    return false;
 }
 
 static int setup_candidates_for_first_keypress(int32_t position, int64_t timestamp) {
     int number_of_combo_candidates = 0;
-    uint8_t highest_active_layer = zmk_keymap_highest_layer_active();
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; i++) {
-        struct combo_cfg *combo = combo_lookup[position][i];
-        if (combo == NULL) {
-            return number_of_combo_candidates;
-        }
-        if (combo_active_on_layer(combo, highest_active_layer)) {
-            candidates[number_of_combo_candidates].combo = combo;
-            candidates[number_of_combo_candidates].timeout_at = timestamp + combo->timeout_ms;
+    // the layer is looked up on every first press instead of on layer_state_changed, so a layer
+    // change that is still queued for dispatch can never leave a stale set of combos selected.
+    const uint32_t *eligible = layer_combos[zmk_keymap_highest_layer_active()];
+    candidates_pressed_at = timestamp;
+    for (int j = combo_lookup_offsets[position]; j < combo_lookup_offsets[position + 1]; j++) {
+        int i = combo_lookup[j];
+        if (eligible[i / 32] & BIT(i % 32)) {
+            candidates[i / 32] |= BIT(i % 32);
             number_of_combo_candidates++;
         }
-        // LOG_DBG("combo timeout %d %d %d", position, i, candidates[i].timeout_at);
     }
     return number_of_combo_candidates;
 }
 
 static int filter_candidates(int32_t position) {
-    // this code iterates over candidates and the lookup together to filter in O(n)
-    // assuming they are both sorted on key_position_len, virtal_key_position
-    int matches = 0, lookup_idx = 0, candidate_idx = 0;
-    while (lookup_idx < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY &&
-           candidate_idx < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY) {
-        struct combo_cfg *candidate = candidates[candidate_idx].combo;
-        struct combo_cfg *lookup = combo_lookup[position][lookup_idx];
-        if (candidate == NULL || lookup == NULL) {
-            break;
-        }
-        if (candidate->virtual_key_position == lookup->virtual_key_position) {
-            candidates[matches] = candidates[candidate_idx];
-            matches++;
-            candidate_idx++;
-            lookup_idx++;
-        } else if (candidate->key_position_len > lookup->key_position_len) {
-            lookup_idx++;
-        } else if (candidate->key_position_len < lookup->key_position_len) {
-            candidate_idx++;
-        } else if (candidate->virtual_key_position > lookup->virtual_key_position) {
-            lookup_idx++;
-        } else if (candidate->virtual_key_position < lookup->virtual_key_position) {
-            candidate_idx++;
-        }
+    // keep only the candidates that include this position
+    uint32_t matches[COMBO_SET_WORDS] = {0};
+    for (int j = combo_lookup_offsets[position]; j < combo_lookup_offsets[position + 1]; j++) {
+        matches[combo_lookup[j] / 32] |= BIT(combo_lookup[j] % 32);
     }
-    // clear unmatched candidates
-    for (int i = matches; i < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; i++) {
-        candidates[i].combo = NULL;
+    for (int word = 0; word < COMBO_SET_WORDS; word++) {
+        candidates[word] &= matches[word];
     }
-    // LOG_DBG("combo matches after filter %d", matches);
-    return matches;
+    return count_combos(candidates);
 }
 
 static int64_t first_candidate_timeout() {
-    int64_t first_timeout = LONG_MAX;
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; i++) {
-        if (candidates[i].combo == NULL) {
-            break;
-        }
-        if (candidates[i].timeout_at < first_timeout) {
-            first_timeout = candidates[i].timeout_at;
-        }
+    int64_t first_timeout = LLONG_MAX;
+    FOR_EACH_COMBO(i, candidates) {
+        first_timeout = MIN(first_timeout, candidates_pressed_at + combos[i]->timeout_ms);
     }
     return first_timeout;
 }
 
 static inline bool candidate_is_completely_pressed(struct combo_cfg *candidate) {
     // this code assumes set(pressed_keys) <= set(candidate->key_positions)
-    // this invariant is enforced by filter_candidates
-    // since events may have been reraised after clearing one or more slots at
-    // the start of pressed_keys (see: release_pressed_keys), we have to check
-    // that each key needed to trigger the combo was pressed, not just the last.
-    for (int i = 0; i < candidate->key_position_len; i++) {
-        if (pressed_keys[i] == NULL) {
-            return false;
-        }
-    }
-    return true;
+    // this invariant is enforced by filter_candidates, so the candidate is completely pressed
+    // exactly when both sets are equal.
+    return memcmp(pressed_positions, candidate->position_mask, sizeof(pressed_positions)) == 0;
 }
 
 static int cleanup();
 
 static int filter_timed_out_candidates(int64_t timestamp) {
     int num_candidates = 0;
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; i++) {
-        struct combo_candidate *candidate = &candidates[i];
-        if (candidate->combo == NULL) {
-            break;
-        }
-        if (candidate->timeout_at > timestamp) {
-            // reorder candidates so they're contiguous
-            candidates[num_candidates].combo = candidate->combo;
-            candidates[num_candidates].timeout_at = candidate->timeout_at;
+    FOR_EACH_COMBO(i, candidates) {
+        if (candidates_pressed_at + combos[i]->timeout_ms > timestamp) {
             num_candidates++;
         } else {
-            candidate->combo = NULL;
+            candidates[i / 32] &= ~BIT(i % 32);
         }
     }
     return num_candidates;
 }
 
 static int clear_candidates() {
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY; i++) {
-        if (candidates[i].combo == NULL) {
-            return i;
-        }
-        candidates[i].combo = NULL;
+    int num_candidates = count_combos(candidates);
+    memset(candidates, 0, sizeof(candidates));
+    return num_candidates;
+}
+
+static void update_pressed_positions() {
+    memset(pressed_positions, 0, sizeof(pressed_positions));
+    struct zmk_captured_event *entry;
+    ZMK_EVENT_CAPTURE_FOR_EACH(&pressed_keys, entry) {
+        uint32_t position = as_zmk_position_state_changed(entry->event)->position;
+        pressed_positions[position / 32] |= BIT(position % 32);
     }
-    return CONFIG_ZMK_COMBO_MAX_COMBOS_PER_KEY;
 }
 
 static int capture_pressed_key(const zmk_event_t *ev) {
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO; i++) {
-        if (pressed_keys[i] != NULL) {
-            continue;
-        }
-        pressed_keys[i] = ev;
-        return ZMK_EV_EVENT_CAPTURED;
+    if (zmk_event_capture_len(&pressed_keys) == COMBO_MAX_KEYS ||
+        zmk_event_capture_push(&pressed_keys, ev) < 0) {
+        return 0;
     }
-    return 0;
+    uint32_t position = as_zmk_position_state_changed(ev)->position;
+    pressed_positions[position / 32] |= BIT(position % 32);
+    return ZMK_EV_EVENT_CAPTURED;
 }
 
 const struct zmk_listener zmk_listener_combo;
 
+// keys replayed after a failed combo already went past the listeners linked before hold-tap, which
+// only observe them, so the replay starts at hold-tap. An undecided hold-tap still sees the keys as
+// interrupts, and every listener from there on handles them in order.
+#if DT_HAS_COMPAT_STATUS_OKAY(zmk_behavior_hold_tap)
+extern const struct zmk_listener zmk_listener_behavior_hold_tap;
+#define COMBO_REPLAY_LISTENER (&zmk_listener_behavior_hold_tap)
+#else
+#define COMBO_REPLAY_LISTENER NULL
+#endif
+
 static int release_pressed_keys() {
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO; i++) {
-        const zmk_event_t *captured_event = pressed_keys[i];
-        if (pressed_keys[i] == NULL) {
-            return i;
-        }
-        pressed_keys[i] = NULL;
-        if (i == 0) {
-            LOG_DBG("combo: releasing position event %d",
-                    as_zmk_position_state_changed(captured_event)->position);
-            ZMK_EVENT_RELEASE(captured_event)
-        } else {
-            // reprocess events (see tests/combo/fully-overlapping-combos-3 for why this is needed)
-            LOG_DBG("combo: reraising position event %d",
-                    as_zmk_position_state_changed(captured_event)->position);
-            ZMK_EVENT_RAISE(captured_event);
-        }
+    // detach the captured keys first, as replaying them may capture keys again.
+    struct zmk_event_capture replay = {};
+    zmk_event_capture_detach(&pressed_keys, &replay);
+    memset(pressed_positions, 0, sizeof(pressed_positions));
+
+    int count = zmk_event_capture_len(&replay);
+    const zmk_event_t *first = zmk_event_capture_pop(&replay);
+    if (first == NULL) {
+        return 0;
     }
-    return CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO;
+    LOG_DBG("combo: releasing position event %d", as_zmk_position_state_changed(first)->position);
+    ZMK_EVENT_RELEASE(first)
+
+    // the keys after the first one are handed back as one batch, from hold-tap onward: they may
+    // start a new combo (see tests/combo/fully-overlapping-combos-3), and an undecided hold-tap
+    // must see them too (see tests/combo/combos-and-holdtaps-5).
+    zmk_event_capture_release_all(&replay, COMBO_REPLAY_LISTENER);
+    return count;
 }
 
 static inline int press_combo_behavior(struct combo_cfg *combo, int32_t timestamp) {
@@ -284,31 +329,22 @@ static inline int release_combo_behavior(struct combo_cfg *combo, int32_t timest
 
 static void move_pressed_keys_to_active_combo(struct active_combo *active_combo) {
     int combo_length = active_combo->combo->key_position_len;
+    // the combo's keys are the oldest pressed keys; any keys pressed after them stay captured.
     for (int i = 0; i < combo_length; i++) {
-        active_combo->key_positions_pressed[i] = pressed_keys[i];
-        pressed_keys[i] = NULL;
-    }
-    // move any other pressed keys up
-    for (int i = 0; i + combo_length < CONFIG_ZMK_COMBO_MAX_KEYS_PER_COMBO; i++) {
-        if (pressed_keys[i + combo_length] == NULL) {
-            return;
-        }
-        pressed_keys[i] = pressed_keys[i + combo_length];
-        pressed_keys[i + combo_length] = NULL;
+        active_combo->key_positions_pressed[i] = zmk_event_capture_pop(&pressed_keys);
     }
+    update_pressed_positions();
 }
 
 static struct active_combo *store_active_combo(struct combo_cfg *combo) {
-    for (int i = 0; i < CONFIG_ZMK_COMBO_MAX_PRESSED_COMBOS; i++) {
+    for (int i = 0; i < COMBO_MAX_ACTIVE; i++) {
         if (active_combos[i].combo == NULL) {
             active_combos[i].combo = combo;
             active_combo_count++;
             return &active_combos[i];
         }
     }
-    LOG_ERR("Unable to store combo; already %d active. Increase "
-            "CONFIG_ZMK_COMBO_MAX_PRESSED_COMBOS",
-            CONFIG_ZMK_COMBO_MAX_PRESSED_COMBOS);
+    LOG_ERR("Unable to store combo; already %d active", (int)COMBO_MAX_ACTIVE);
     return NULL;
 }
 
@@ -370,7 +406,7 @@ static bool release_combo_key(int32_t position, int64_t timestamp) {
 }
 
 static int cleanup() {
-    k_work_cancel_delayable(&timeout_task);
+    zmk_timer_cancel(&timeout_timer);
     clear_candidates();
     if (fully_pressed_combo != NULL) {
         activate_combo(fully_pressed_combo);
@@ -381,22 +417,16 @@ static int cleanup() {
 
 static void update_timeout_task() {
     int64_t first_timeout = first_candidate_timeout();
-    if (timeout_task_timeout_at == first_timeout) {
-        return;
-    }
     if (first_timeout == LLONG_MAX) {
-        timeout_task_timeout_at = 0;
-        k_work_cancel_delayable(&timeout_task);
+        zmk_timer_cancel(&timeout_timer);
         return;
     }
-    if (k_work_schedule(&timeout_task, K_MSEC(first_timeout - k_uptime_get())) >= 0) {
-        timeout_task_timeout_at = first_timeout;
-    }
+    zmk_timer_start(&timeout_timer, first_timeout);
 }
 
 static int position_state_down(const zmk_event_t *ev, struct zmk_position_state_changed *data) {
     int num_candidates;
-    if (candidates[0].combo == NULL) {
+    if (next_combo(candidates, 0) < 0) {
         num_candidates = setup_candidates_for_first_keypress(data->position, data->timestamp);
         if (num_candidates == 0) {
             return 0;
@@ -407,7 +437,8 @@ static int position_state_down(const zmk_event_t *ev, struct zmk_position_state_
     }
     update_timeout_task();
 
-    struct combo_cfg *candidate_combo = candidates[0].combo;
+    int first_candidate = next_combo(candidates, 0);
+    struct combo_cfg *candidate_combo = first_candidate < 0 ? NULL : combos[first_candidate];
     LOG_DBG("combo: capturing position event %d", data->position);
     int ret = capture_pressed_key(ev);
     switch (num_candidates) {
@@ -434,20 +465,18 @@ static int position_state_up(const zmk_event_t *ev, struct zmk_position_state_ch
         return ZMK_EV_EVENT_HANDLED;
     }
     if (released_keys > 1) {
-        // The second and further key down events are re-raised. To preserve
-        // correct order for e.g. hold-taps, reraise the key up event too.
-        ZMK_EVENT_RAISE(ev);
+        // The second and further key down events are replayed. To preserve
+        // correct order for e.g. hold-taps, replay the key up event the same way.
+        struct zmk_event_capture replay = {};
+        zmk_event_capture_push(&replay, ev);
+        zmk_event_capture_release_all(&replay, COMBO_REPLAY_LISTENER);
         return ZMK_EV_EVENT_CAPTURED;
     }
     return 0;
 }
 
-static void combo_timeout_handler(struct k_work *item) {
-    if (timeout_task_timeout_at == 0 || k_uptime_get() < timeout_task_timeout_at) {
-        // timer was cancelled or rescheduled.
-        return;
-    }
-    if (filter_timed_out_candidates(timeout_task_timeout_at) < 2) {
+static void combo_timeout_handler(struct zmk_timer *timer) {
+    if (filter_timed_out_candidates(timer->deadline) < 2) {
         cleanup();
     }
     update_timeout_task();
@@ -469,25 +498,24 @@ static int position_state_changed_listener(const zmk_event_t *ev) {
 ZMK_LISTENER(combo, position_state_changed_listener);
 ZMK_SUBSCRIPTION(combo, zmk_position_state_changed);
 
-#define COMBO_INST(n)                                                                              \
-    static struct combo_cfg combo_config_##n = {                                                   \
-        .timeout_ms = DT_PROP(n, timeout_ms),                                                      \
-        .key_positions = DT_PROP(n, key_positions),                                                \
-        .key_position_len = DT_PROP_LEN(n, key_positions),                                         \
-        .behavior = ZMK_KEYMAP_EXTRACT_BINDING(0, n),                                              \
-        .virtual_key_position = ZMK_KEYMAP_LEN + __COUNTER__,                                      \
-        .slow_release = DT_PROP(n, slow_release),                                                  \
-        .layers = DT_PROP(n, layers),                                                              \
-        .layers_len = DT_PROP_LEN(n, layers),                                                      \
-    };
-
-#define INITIALIZE_COMBO(n) initialize_combo(&combo_config_##n);
-
-DT_INST_FOREACH_CHILD(0, COMBO_INST)
-
 static int combo_init() {
-    k_work_init_delayable(&timeout_task, combo_timeout_handler);
-    DT_INST_FOREACH_CHILD(0, INITIALIZE_COMBO);
+    zmk_timer_init(&timeout_timer, combo_timeout_handler);
+
+    // combos starts out in virtual-key-position order, so a stable sort on length gives the
+    // shortest-first, then by virtual-key-position order the candidates depend on.
+    for (int i = 1; i < NUM_COMBOS; i++) {
+        struct combo_cfg *combo = combos[i];
+        int j = i;
+        for (; j > 0 && combos[j - 1]->key_position_len > combo->key_position_len; j--) {
+            combos[j] = combos[j - 1];
+        }
+        combos[j] = combo;
+    }
+
+    for (int i = 0; i < NUM_COMBOS; i++) {
+        initialize_combo(i);
+    }
+    initialize_combo_lookup();
     return 0;
 }
 
@@ -33,7 +33,7 @@ struct conditional_layer_cfg {
     int8_t then_layer;
 };
 
-#define IF_LAYER_BIT(i, n) BIT(DT_PROP_BY_IDX(n, if_layers, i)) |
+#define IF_LAYER_BIT(i, n) ZMK_KEYMAP_LAYER_BIT(DT_PROP_BY_IDX(n, if_layers, i)) |
 
 // Evaluates to conditional_layer_cfg struct initializer.
 #define CONDITIONAL_LAYER_DECL(n)                                                                  \
@@ -50,28 +50,45 @@ static const struct conditional_layer_cfg CONDITIONAL_LAYER_CFGS[] = {
 static const int32_t NUM_CONDITIONAL_LAYER_CFGS =
     sizeof(CONDITIONAL_LAYER_CFGS) / sizeof(*CONDITIONAL_LAYER_CFGS);
 
-static void conditional_layer_activate(int8_t layer) {
+#define CONDITIONAL_LAYER_BITS(n)                                                                  \
+    UTIL_LISTIFY(DT_PROP_LEN(n, if_layers), IF_LAYER_BIT, n)                                       \
+    ZMK_KEYMAP_LAYER_BIT(DT_PROP(n, then_layer)) |
+
+// Every layer used by any config. Changes to other layers can't affect any then-layer.
+static const zmk_keymap_layers_state_t CONDITIONAL_LAYERS_MASK =
+    DT_INST_FOREACH_CHILD(0, CONDITIONAL_LAYER_BITS) 0;
+
+// The activate/deactivate helpers only mark the layers that need to change in the changes mask.
+// They are then all applied with one layer state update, so the rest of the system sees a single
+// zmk_layer_state_changed event instead of one per then-layer.
+static void conditional_layer_activate(int8_t layer, zmk_keymap_layers_state_t *changes) {
     // This may trigger another event that could, in turn, activate additional then-layers. However,
     // the process will eventually terminate (at worst, when every layer is active).
     if (!zmk_keymap_layer_active(layer)) {
         LOG_DBG("layer %d", layer);
-        zmk_keymap_layer_activate(layer);
+        *changes |= ZMK_KEYMAP_LAYER_BIT(layer);
     }
 }
 
-static void conditional_layer_deactivate(int8_t layer) {
+static void conditional_layer_deactivate(int8_t layer, zmk_keymap_layers_state_t *changes) {
     // This may deactivate a then-layer that's already active via another mechanism (e.g., a
     // momentary layer behavior). However, the same problem arises when multiple keys with the same
     // &mo binding are held and then one is released, so it's probably not an issue in practice.
     if (zmk_keymap_layer_active(layer)) {
         LOG_DBG("layer %d", layer);
-        zmk_keymap_layer_deactivate(layer);
+        *changes |= ZMK_KEYMAP_LAYER_BIT(layer);
     }
 }
 
 static int layer_state_changed_listener(const zmk_event_t *ev) {
     static bool conditional_layer_updates_needed;
 
+    const struct zmk_layer_state_changed *state_ev = as_zmk_layer_state_changed(ev);
+    if (state_ev != NULL &&
+        ((state_ev->old_state ^ state_ev->new_state) & CONDITIONAL_LAYERS_MASK) == 0) {
+        return 0;
+    }
+
     conditional_layer_updates_needed = true;
 
     // Semaphore ensures we don't re-enter the loop in the middle of doing update, and
@@ -83,8 +100,9 @@ static int layer_state_changed_listener(const zmk_event_t *ev) {
 
     while (conditional_layer_updates_needed) {
         int8_t max_then_layer = -1;
-        uint32_t then_layers = 0;
-        uint32_t then_layer_state = 0;
+        zmk_keymap_layers_state_t then_layers = 0;
+        zmk_keymap_layers_state_t then_layer_state = 0;
+        zmk_keymap_layers_state_t changes = 0;
 
         conditional_layer_updates_needed = false;
 
@@ -93,26 +111,30 @@ static int layer_state_changed_listener(const zmk_event_t *ev) {
         for (int i = 0; i < NUM_CONDITIONAL_LAYER_CFGS; i++) {
             const struct conditional_layer_cfg *cfg = CONDITIONAL_LAYER_CFGS + i;
             zmk_keymap_layers_state_t mask = cfg->if_layers_state_mask;
-            then_layers |= BIT(cfg->then_layer);
+            then_layers |= ZMK_KEYMAP_LAYER_BIT(cfg->then_layer);
             max_then_layer = MAX(max_then_layer, cfg->then_layer);
 
             // Activate then-layer if and only if all if-layers are already active. Note that we
             // reevaluate the current layer state for each config since activation of one layer can
             // also trigger activation of another.
             if ((zmk_keymap_layer_state() & mask) == mask) {
-                then_layer_state |= BIT(cfg->then_layer);
+                then_layer_state |= ZMK_KEYMAP_LAYER_BIT(cfg->then_layer);
             }
         }
 
         for (uint8_t layer = 0; layer <= max_then_layer; layer++) {
-            if ((BIT(layer) & then_layers) != 0U) {
-                if ((BIT(layer) & then_layer_state) != 0U) {
-                    conditional_layer_activate(layer);
+            if ((ZMK_KEYMAP_LAYER_BIT(layer) & then_layers) != 0U) {
+                if ((ZMK_KEYMAP_LAYER_BIT(layer) & then_layer_state) != 0U) {
+                    conditional_layer_activate(layer, &changes);
                 } else {
-                    conditional_layer_deactivate(layer);
+                    conditional_layer_deactivate(layer, &changes);
                 }
             }
         }
+
+        if (changes != 0U) {
+            zmk_keymap_layer_state_set(changes, then_layer_state);
+        }
     }
 
     k_sem_give(&conditional_layer_sem);
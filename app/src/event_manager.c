@@ -5,7 +5,14 @@
  */
 
 #include <zephyr.h>
+#include <device.h>
+#include <init.h>
 #include <logging/log.h>
+#include <sys/printk.h>
+
+#if IS_ENABLED(CONFIG_SHELL)
+#include <shell/shell.h>
+#endif
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 
@@ -17,16 +24,132 @@ extern struct zmk_event_type *__event_type_end[];
 extern struct zmk_event_subscription __event_subscriptions_start[];
 extern struct zmk_event_subscription __event_subscriptions_end[];
 
+void *zmk_event_manager_alloc(const struct zmk_event_type *type, size_t size) {
+    void *mem;
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL)
+    struct zmk_event_pool *pool = type->pool;
+
+    if (k_mem_slab_alloc(pool->slab, &mem, K_NO_WAIT) == 0) {
+        pool->high_water_mark = MAX(pool->high_water_mark, k_mem_slab_num_used_get(pool->slab));
+        goto allocated;
+    }
+
+    // The pool is exhausted, e.g. because many events are captured by hold-taps. Fall back to
+    // the heap so no event is lost. Only the first overflow is logged, since a pool that is too
+    // small overflows on every event of a burst; the stats count the rest.
+    if (pool->overflows++ == 0) {
+        LOG_WRN("Event pool for %s exhausted, allocating from the heap", type->name);
+    }
+#endif
+
+    mem = k_malloc(size);
+    if (mem == NULL) {
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL)
+        pool->failures++;
+#endif
+        LOG_ERR("Unable to allocate %s event", type->name);
+        return NULL;
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL)
+allocated:
+#endif
+    ((zmk_event_t *)mem)->capture_refs = 0;
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+    type->stats->raised++;
+    ((zmk_event_t *)mem)->raised_at = k_cycle_get_32();
+#endif
+    return mem;
+}
+
+void zmk_event_manager_free(const zmk_event_t *event) {
+    if (event->capture_refs > 0) {
+        LOG_ERR("Not freeing %s event, it is still captured", event->event->name);
+        return;
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+    struct zmk_event_type_stats *stats = event->event->stats;
+    uint32_t lifetime = k_cycle_get_32() - event->raised_at;
+
+    stats->freed++;
+    stats->total_lifetime_cycles += lifetime;
+    stats->max_lifetime_cycles = MAX(stats->max_lifetime_cycles, lifetime);
+#endif
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_POOL)
+    struct k_mem_slab *slab = event->event->pool->slab;
+    char *block = (char *)event;
+
+    if (block >= slab->buffer && block < slab->buffer + (slab->num_blocks * slab->block_size)) {
+        k_mem_slab_free(slab, (void **)&block);
+        return;
+    }
+#endif
+
+    k_free((void *)event);
+}
+
+// The subscriptions of the event's type. The linker already groups them by event type, in link
+// order within each group, so they are used in place.
+static inline const struct zmk_event_subscription *get_subscriptions(const zmk_event_t *event) {
+    return __event_subscriptions_start + event->event->dispatch->offset;
+}
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+static inline struct zmk_event_listener_stats *get_listener_stats(const zmk_event_t *event,
+                                                                  uint8_t index) {
+    return get_subscriptions(event)[index].stats;
+}
+
+static void record_listener_call(struct zmk_event_listener_stats *stats, uint32_t cycles,
+                                 int ret) {
+    stats->calls++;
+    stats->total_cycles += cycles;
+    stats->max_cycles = MAX(stats->max_cycles, cycles);
+    if (ret == ZMK_EV_EVENT_CAPTURED) {
+        stats->captures++;
+    }
+}
+#endif
+
+static int zmk_event_manager_find_listener(const zmk_event_t *event,
+                                           const struct zmk_listener *listener) {
+    const struct zmk_event_dispatch *dispatch = event->event->dispatch;
+    const struct zmk_event_subscription *subs = get_subscriptions(event);
+
+    // Events are almost always re-raised by the listener that last handled or captured them, so
+    // check that one before searching the subscriptions of this event type.
+    if (event->last_listener_index < dispatch->len &&
+        subs[event->last_listener_index].listener == listener) {
+        return event->last_listener_index;
+    }
+
+    for (int i = 0; i < dispatch->len; i++) {
+        if (subs[i].listener == listener) {
+            return i;
+        }
+    }
+
+    return -EINVAL;
+}
+
 int zmk_event_manager_handle_from(zmk_event_t *event, uint8_t start_index) {
     int ret = 0;
-    uint8_t len = __event_subscriptions_end - __event_subscriptions_start;
-    for (int i = start_index; i < len; i++) {
-        struct zmk_event_subscription *ev_sub = __event_subscriptions_start + i;
-        if (ev_sub->event_type != event->event) {
-            continue;
-        }
+    const struct zmk_event_dispatch *dispatch = event->event->dispatch;
+    const struct zmk_event_subscription *subs = get_subscriptions(event);
+    for (int i = start_index; i < dispatch->len; i++) {
         event->last_listener_index = i;
-        ret = ev_sub->listener->callback(event);
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+        // The event may already be freed once the callback returns, so look up the counters first.
+        struct zmk_event_listener_stats *stats = get_listener_stats(event, i);
+        uint32_t start = k_cycle_get_32();
+        ret = subs[i].listener->callback(event);
+        record_listener_call(stats, k_cycle_get_32() - start, ret);
+#else
+        ret = subs[i].listener->callback(event);
+#endif
         switch (ret) {
         case ZMK_EV_EVENT_BUBBLE:
             continue;
@@ -45,42 +168,399 @@ int zmk_event_manager_handle_from(zmk_event_t *event, uint8_t start_index) {
     }
 
 release:
-    k_free(event);
+    zmk_event_manager_free(event);
     return ret;
 }
 
-int zmk_event_manager_raise(zmk_event_t *event) { return zmk_event_manager_handle_from(event, 0); }
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_DEFERRED)
 
-int zmk_event_manager_raise_after(zmk_event_t *event, const struct zmk_listener *listener) {
-    uint8_t len = __event_subscriptions_end - __event_subscriptions_start;
-    for (int i = 0; i < len; i++) {
-        struct zmk_event_subscription *ev_sub = __event_subscriptions_start + i;
+struct deferred_event {
+    zmk_event_t *event;
+    uint32_t queued_at;
+    uint8_t start_index;
+};
 
-        if (ev_sub->event_type == event->event && ev_sub->listener == listener) {
-            return zmk_event_manager_handle_from(event, i + 1);
+K_MSGQ_DEFINE(deferred_event_msgq, sizeof(struct deferred_event),
+              CONFIG_ZMK_EVENT_MANAGER_DEFERRED_QUEUE_SIZE, 4);
+
+static struct zmk_event_queue_stats queue_stats;
+// Producers on several threads update the queue stats, so they are only changed under this lock.
+static struct k_spinlock queue_stats_lock;
+
+const struct zmk_event_queue_stats *zmk_event_manager_queue_stats() { return &queue_stats; }
+
+K_THREAD_STACK_DEFINE(event_work_q_stack, CONFIG_ZMK_EVENT_MANAGER_DEFERRED_THREAD_STACK_SIZE);
+// the event thread. Behavior timers are submitted to it as well, so a timer never fires while a
+// listener is handling an event, even if the listener sleeps.
+static struct k_work_q event_work_q;
+
+struct k_work_q *zmk_event_manager_work_q() { return &event_work_q; }
+
+static void deferred_event_work_handler(struct k_work *work) {
+    struct deferred_event item;
+
+    while (k_msgq_get(&deferred_event_msgq, &item, K_NO_WAIT) == 0) {
+        uint32_t latency = k_cycle_get_32() - item.queued_at;
+        k_spinlock_key_t key = k_spin_lock(&queue_stats_lock);
+        queue_stats.dispatched++;
+        queue_stats.total_latency_cycles += latency;
+        queue_stats.max_latency_cycles = MAX(queue_stats.max_latency_cycles, latency);
+        k_spin_unlock(&queue_stats_lock, key);
+
+        zmk_event_manager_handle_from(item.event, item.start_index);
+    }
+}
+
+static K_WORK_DEFINE(deferred_event_work, deferred_event_work_handler);
+
+static int zmk_event_manager_dispatch(zmk_event_t *event, uint8_t start_index) {
+    // Events raised by listeners and behavior timers are already running on the event thread.
+    // Handle those inline so nested events keep the exact ordering they had before deferral.
+    if (k_current_get() == &event_work_q.thread) {
+        return zmk_event_manager_handle_from(event, start_index);
+    }
+
+    struct deferred_event item = {
+        .event = event,
+        .queued_at = k_cycle_get_32(),
+        .start_index = start_index,
+    };
+
+    // Threads never drop events. If the queue is full, the producer waits for the event thread to
+    // catch up instead. An ISR cannot wait, so its event is dropped and counted.
+    if (k_msgq_put(&deferred_event_msgq, &item, K_NO_WAIT) < 0) {
+        if (k_is_in_isr()) {
+            k_spinlock_key_t key = k_spin_lock(&queue_stats_lock);
+            queue_stats.dropped++;
+            k_spin_unlock(&queue_stats_lock, key);
+            LOG_ERR("Event queue full, dropping %s event raised from an ISR", event->event->name);
+            zmk_event_manager_free(event);
+            return -ENOMEM;
         }
+
+        k_spinlock_key_t key = k_spin_lock(&queue_stats_lock);
+        queue_stats.blocked++;
+        k_spin_unlock(&queue_stats_lock, key);
+        k_msgq_put(&deferred_event_msgq, &item, K_FOREVER);
     }
 
-    LOG_WRN("Unable to find where to raise this after event");
+    k_spinlock_key_t key = k_spin_lock(&queue_stats_lock);
+    queue_stats.high_water_mark =
+        MAX(queue_stats.high_water_mark, k_msgq_num_used_get(&deferred_event_msgq));
+    k_spin_unlock(&queue_stats_lock, key);
+    k_work_submit_to_queue(&event_work_q, &deferred_event_work);
 
-    return -EINVAL;
+    return 0;
+}
+
+static int zmk_event_manager_deferred_init(const struct device *_arg) {
+    k_work_queue_start(&event_work_q, event_work_q_stack,
+                       K_THREAD_STACK_SIZEOF(event_work_q_stack),
+                       CONFIG_ZMK_EVENT_MANAGER_DEFERRED_THREAD_PRIORITY, NULL);
+    k_thread_name_set(&event_work_q.thread, "zmk_events");
+    return 0;
+}
+
+SYS_INIT(zmk_event_manager_deferred_init, POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+
+#else
+
+struct k_work_q *zmk_event_manager_work_q() { return &k_sys_work_q; }
+
+static inline int zmk_event_manager_dispatch(zmk_event_t *event, uint8_t start_index) {
+    return zmk_event_manager_handle_from(event, start_index);
+}
+
+#endif /* IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_DEFERRED) */
+
+int zmk_event_manager_raise(zmk_event_t *event) {
+    if (event == NULL) {
+        // new_<event_type> could not allocate the event.
+        return -ENOMEM;
+    }
+    return zmk_event_manager_dispatch(event, 0);
+}
+
+int zmk_event_manager_raise_after(zmk_event_t *event, const struct zmk_listener *listener) {
+    if (event == NULL) {
+        return -ENOMEM;
+    }
+
+    int index = zmk_event_manager_find_listener(event, listener);
+    if (index < 0) {
+        LOG_WRN("Unable to find where to raise this after event");
+        return index;
+    }
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+    get_listener_stats(event, index)->releases++;
+#endif
+
+    return zmk_event_manager_dispatch(event, index + 1);
 }
 
 int zmk_event_manager_raise_at(zmk_event_t *event, const struct zmk_listener *listener) {
-    uint8_t len = __event_subscriptions_end - __event_subscriptions_start;
-    for (int i = 0; i < len; i++) {
-        struct zmk_event_subscription *ev_sub = __event_subscriptions_start + i;
+    if (event == NULL) {
+        return -ENOMEM;
+    }
 
-        if (ev_sub->event_type == event->event && ev_sub->listener == listener) {
-            return zmk_event_manager_handle_from(event, i);
-        }
+    int index = zmk_event_manager_find_listener(event, listener);
+    if (index < 0) {
+        LOG_WRN("Unable to find where to raise this event");
+        return index;
     }
 
-    LOG_WRN("Unable to find where to raise this event");
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+    get_listener_stats(event, index)->releases++;
+#endif
 
-    return -EINVAL;
+    return zmk_event_manager_dispatch(event, index);
 }
 
 int zmk_event_manager_release(zmk_event_t *event) {
-    return zmk_event_manager_handle_from(event, event->last_listener_index + 1);
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+    get_listener_stats(event, event->last_listener_index)->releases++;
+#endif
+    return zmk_event_manager_dispatch(event, event->last_listener_index + 1);
+}
+
+static struct zmk_event_capture_stats capture_stats;
+// Number of events held by all captures.
+static uint32_t capture_depth;
+
+int zmk_event_capture_push(struct zmk_event_capture *capture, const zmk_event_t *event) {
+    // The event links into the capture through its own header, so it can only be in one capture
+    // at a time. Listeners capture an event again only after the previous capture released it.
+    if (event->capture_refs > 0 || capture->len == UINT8_MAX) {
+        capture_stats.failures++;
+        return -EBUSY;
+    }
+
+    zmk_event_t *held = (zmk_event_t *)event;
+    held->capture_refs++;
+    sys_slist_append(&capture->events, &held->capture_node);
+    capture->len++;
+
+    capture_depth++;
+    capture_stats.high_water_mark = MAX(capture_stats.high_water_mark, capture_depth);
+    return 0;
+}
+
+const zmk_event_t *zmk_event_capture_pop(struct zmk_event_capture *capture) {
+    sys_snode_t *node = sys_slist_get(&capture->events);
+    if (node == NULL) {
+        return NULL;
+    }
+    capture->len--;
+    capture_depth--;
+
+    zmk_event_t *event = CONTAINER_OF(node, zmk_event_t, capture_node);
+    event->capture_refs--;
+    return event;
+}
+
+void zmk_event_capture_detach(struct zmk_event_capture *capture, struct zmk_event_capture *into) {
+    sys_slist_merge_slist(&into->events, &capture->events);
+    into->len += capture->len;
+    capture->len = 0;
+}
+
+void zmk_event_capture_release_all(struct zmk_event_capture *capture,
+                                   const struct zmk_listener *listener) {
+    struct zmk_event_capture releasing = {};
+    zmk_event_capture_detach(capture, &releasing);
+
+    const zmk_event_t *event;
+    while ((event = zmk_event_capture_pop(&releasing)) != NULL) {
+        LOG_DBG("Releasing captured %s event", event->event->name);
+        if (listener == NULL) {
+            zmk_event_manager_raise((zmk_event_t *)event);
+        } else {
+            zmk_event_manager_raise_at((zmk_event_t *)event, listener);
+        }
+    }
+}
+
+uint32_t zmk_event_manager_capture_depth() { return capture_depth; }
+
+const struct zmk_event_capture_stats *zmk_event_manager_capture_stats() { return &capture_stats; }
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION)
+
+void zmk_event_manager_stats_reset() {
+    for (struct zmk_event_type **type = __event_type_start; type < __event_type_end; type++) {
+        memset((*type)->stats, 0, sizeof(struct zmk_event_type_stats));
+    }
+    for (struct zmk_event_subscription *sub = __event_subscriptions_start;
+         sub < __event_subscriptions_end; sub++) {
+        memset(sub->stats, 0, sizeof(struct zmk_event_listener_stats));
+    }
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_DEFERRED)
+    k_spinlock_key_t key = k_spin_lock(&queue_stats_lock);
+    memset(&queue_stats, 0, sizeof(queue_stats));
+    k_spin_unlock(&queue_stats_lock, key);
+#endif
+    capture_stats.failures = 0;
+    capture_stats.high_water_mark = zmk_event_manager_capture_depth();
+}
+
+static inline uint32_t average_us(uint64_t total_cycles, uint32_t count) {
+    return count == 0 ? 0 : (uint32_t)(k_cyc_to_us_floor64(total_cycles) / count);
+}
+
+static void format_event_type_stats(char *buf, size_t len, const struct zmk_event_type *type) {
+    const struct zmk_event_type_stats *stats = type->stats;
+
+    snprintk(buf, len, "%s: raised %u freed %u lifetime avg %uus max %uus", type->name,
+             stats->raised, stats->freed, average_us(stats->total_lifetime_cycles, stats->freed),
+             k_cyc_to_us_floor32(stats->max_lifetime_cycles));
+}
+
+static void format_listener_stats(char *buf, size_t len, const struct zmk_event_type *type,
+                                  uint8_t index) {
+    const struct zmk_event_subscription *sub =
+        &__event_subscriptions_start[type->dispatch->offset + index];
+    const struct zmk_event_listener_stats *stats = sub->stats;
+
+    snprintk(buf, len, "  %s: calls %u captures %u releases %u time avg %uus max %uus",
+             sub->listener->name, stats->calls, stats->captures,
+             stats->releases, average_us(stats->total_cycles, stats->calls),
+             k_cyc_to_us_floor32(stats->max_cycles));
+}
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_DEFERRED)
+static void format_queue_stats(char *buf, size_t len) {
+    k_spinlock_key_t key = k_spin_lock(&queue_stats_lock);
+    struct zmk_event_queue_stats stats = queue_stats;
+    k_spin_unlock(&queue_stats_lock, key);
+
+    snprintk(buf, len,
+             "queue: dispatched %u blocked %u dropped %u depth max %u latency avg %uus max %uus",
+             stats.dispatched, stats.blocked, stats.dropped, stats.high_water_mark,
+             average_us(stats.total_latency_cycles, stats.dispatched),
+             k_cyc_to_us_floor32(stats.max_latency_cycles));
+}
+#endif
+
+static void format_capture_stats(char *buf, size_t len) {
+    snprintk(buf, len, "captures: depth %u max %u failures %u", zmk_event_manager_capture_depth(),
+             capture_stats.high_water_mark, capture_stats.failures);
+}
+
+void zmk_event_manager_stats_log() {
+    char line[128];
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_DEFERRED)
+    format_queue_stats(line, sizeof(line));
+    LOG_INF("%s", log_strdup(line));
+#endif
+    format_capture_stats(line, sizeof(line));
+    LOG_INF("%s", log_strdup(line));
+
+    for (struct zmk_event_type **type = __event_type_start; type < __event_type_end; type++) {
+        format_event_type_stats(line, sizeof(line), *type);
+        LOG_INF("%s", log_strdup(line));
+        for (uint8_t i = 0; i < (*type)->dispatch->len; i++) {
+            format_listener_stats(line, sizeof(line), *type, i);
+            LOG_INF("%s", log_strdup(line));
+        }
+    }
+}
+
+#if CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION_LOG_INTERVAL > 0
+
+static uint32_t last_logged_calls;
+
+static void stats_log_work_handler(struct k_work *work) {
+    uint32_t calls = 0;
+    for (struct zmk_event_subscription *sub = __event_subscriptions_start;
+         sub < __event_subscriptions_end; sub++) {
+        calls += sub->stats->calls;
+    }
+
+    // Only log when something happened since the last dump to avoid flooding an idle log.
+    if (calls != last_logged_calls) {
+        last_logged_calls = calls;
+        zmk_event_manager_stats_log();
+    }
+
+    k_work_schedule(k_work_delayable_from_work(work),
+                    K_MSEC(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION_LOG_INTERVAL));
+}
+
+static K_WORK_DELAYABLE_DEFINE(stats_log_work, stats_log_work_handler);
+
+static int stats_log_init(const struct device *_arg) {
+    k_work_schedule(&stats_log_work, K_MSEC(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION_LOG_INTERVAL));
+    return 0;
+}
+
+SYS_INIT(stats_log_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#endif /* CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION_LOG_INTERVAL > 0 */
+
+#if IS_ENABLED(CONFIG_SHELL)
+
+static int cmd_events_stats(const struct shell *shell, size_t argc, char **argv) {
+    char line[128];
+
+#if IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_DEFERRED)
+    format_queue_stats(line, sizeof(line));
+    shell_print(shell, "%s", line);
+#endif
+    format_capture_stats(line, sizeof(line));
+    shell_print(shell, "%s", line);
+
+    for (struct zmk_event_type **type = __event_type_start; type < __event_type_end; type++) {
+        format_event_type_stats(line, sizeof(line), *type);
+        shell_print(shell, "%s", line);
+        for (uint8_t i = 0; i < (*type)->dispatch->len; i++) {
+            format_listener_stats(line, sizeof(line), *type, i);
+            shell_print(shell, "%s", line);
+        }
+    }
+
+    return 0;
+}
+
+static int cmd_events_reset(const struct shell *shell, size_t argc, char **argv) {
+    zmk_event_manager_stats_reset();
+    shell_print(shell, "Event manager statistics cleared");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_events,
+                               SHELL_CMD(stats, NULL, "Print event and listener statistics",
+                                         cmd_events_stats),
+                               SHELL_CMD(reset, NULL, "Clear all statistics", cmd_events_reset),
+                               SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(events, &sub_events, "ZMK event manager commands", NULL);
+
+#endif /* IS_ENABLED(CONFIG_SHELL) */
+
+#endif /* IS_ENABLED(CONFIG_ZMK_EVENT_MANAGER_INSTRUMENTATION) */
+
+static int zmk_event_manager_init(const struct device *_arg) {
+    int len = __event_subscriptions_end - __event_subscriptions_start;
+
+    if (len > UINT8_MAX) {
+        LOG_ERR("Too many event subscriptions: %d, max is %d", len, UINT8_MAX);
+        return -ENOMEM;
+    }
+
+    // The subscriptions of each event type are next to each other, so each group only needs to
+    // record where it starts and how long it is.
+    for (int i = 0; i < len; i++) {
+        struct zmk_event_dispatch *dispatch = __event_subscriptions_start[i].event_type->dispatch;
+
+        if (dispatch->len == 0) {
+            dispatch->offset = i;
+        }
+        dispatch->len++;
+    }
+
+    return 0;
 }
+
+SYS_INIT(zmk_event_manager_init, PRE_KERNEL_1, 0);
@@ -5,6 +5,8 @@
  */
 
 #include <sys/util.h>
+#include <init.h>
+#include <settings/settings.h>
 #include <bluetooth/bluetooth.h>
 #include <logging/log.h>
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
@@ -30,9 +32,12 @@ static uint8_t _zmk_keymap_layer_default = 0;
 
 #define DT_DRV_COMPAT zmk_keymap
 
-#define LAYER_CHILD_LEN(node) 1 +
 #define ZMK_KEYMAP_NODE DT_DRV_INST(0)
-#define ZMK_KEYMAP_LAYERS_LEN (DT_INST_FOREACH_CHILD(0, LAYER_CHILD_LEN) 0)
+#define ZMK_KEYMAP_LAYERS_MASK                                                                     \
+    ((zmk_keymap_layers_state_t)(UINT64_MAX >> (64 - ZMK_KEYMAP_LAYERS_LEN)))
+
+BUILD_ASSERT(ZMK_KEYMAP_LAYERS_LEN <= ZMK_KEYMAP_LAYERS_STATE_BITS,
+             "The keymap has more layers than CONFIG_ZMK_KEYMAP_LAYERS_STATE allows");
 
 #define BINDING_WITH_COMMA(idx, drv_inst) ZMK_KEYMAP_EXTRACT_BINDING(idx, drv_inst),
 
@@ -64,43 +69,190 @@ static uint8_t _zmk_keymap_layer_default = 0;
 // When a behavior handles a key position "down" event, we record the layer state
 // here so that even if that layer is deactivated before the "up", event, we
 // still send the release event to the behavior in that layer also.
-static uint32_t zmk_keymap_active_behavior_layer[ZMK_KEYMAP_LEN];
+static zmk_keymap_layers_state_t zmk_keymap_active_behavior_layer[ZMK_KEYMAP_LEN];
+
+// The highest layer to start processing each position from when it was pressed. Recorded together
+// with zmk_keymap_active_behavior_layer so the release starts from the same binding as the press.
+static uint8_t zmk_keymap_active_behavior_start[ZMK_KEYMAP_LEN];
+
+// For each position, bit N is set when the binding on layer N is anything other than &trans.
+static zmk_keymap_layers_state_t zmk_keymap_opaque_layers[ZMK_KEYMAP_LEN];
+
+// For each position, the highest active layer with a binding that is not &trans. Updated whenever
+// the layer state changes, so a press can skip straight past any transparent layers above it.
+static uint8_t zmk_keymap_effective_layer[ZMK_KEYMAP_LEN];
 
-static struct zmk_behavior_binding zmk_keymap[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_LEN] = {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SETTINGS_STORAGE)
+
+// The keymap as defined in devicetree. Only bindings that differ from this are saved to settings.
+static const struct zmk_behavior_binding zmk_keymap_default[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_LEN] =
+    {DT_INST_FOREACH_CHILD(0, TRANSFORMED_LAYER)};
+
+// Copied from zmk_keymap_default at init, then overwritten by any changes loaded from settings.
+static struct zmk_behavior_binding zmk_keymap[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_LEN];
+
+#else
+
+// Without runtime changes the keymap never changes, so keep it in flash instead of RAM.
+static const struct zmk_behavior_binding zmk_keymap[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_LEN] = {
     DT_INST_FOREACH_CHILD(0, TRANSFORMED_LAYER)};
 
-static const char *zmk_keymap_layer_names[ZMK_KEYMAP_LAYERS_LEN] = {
+#endif /* IS_ENABLED(CONFIG_ZMK_KEYMAP_SETTINGS_STORAGE) */
+
+static const char *const zmk_keymap_layer_names[ZMK_KEYMAP_LAYERS_LEN] = {
     DT_INST_FOREACH_CHILD(0, LAYER_LABEL)};
 
 #if ZMK_KEYMAP_HAS_SENSORS
 
-static struct zmk_behavior_binding zmk_sensor_keymap[ZMK_KEYMAP_LAYERS_LEN]
-                                                    [ZMK_KEYMAP_SENSORS_LEN] = {
-                                                        DT_INST_FOREACH_CHILD(0, SENSOR_LAYER)};
+static const struct zmk_behavior_binding
+    zmk_sensor_keymap[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_SENSORS_LEN] = {
+        DT_INST_FOREACH_CHILD(0, SENSOR_LAYER)};
 
 #endif /* ZMK_KEYMAP_HAS_SENSORS */
 
-static inline int set_layer_state(uint8_t layer, bool state) {
-    if (layer >= ZMK_KEYMAP_LAYERS_LEN) {
-        return -EINVAL;
+// Looking up a behavior device by name is a linear string search over every device, so each
+// binding remembers which entry of this cache its behavior resolved to. Index 0 means the binding
+// has not been resolved yet, and BEHAVIOR_UNCACHED means the cache was full when it was.
+#define BEHAVIOR_UNRESOLVED 0
+#define BEHAVIOR_UNCACHED UINT8_MAX
+
+struct behavior_cache_entry {
+    const char *name;
+    const struct device *dev;
+};
+
+static struct behavior_cache_entry behavior_cache[CONFIG_ZMK_KEYMAP_BEHAVIOR_CACHE_SIZE];
+static uint8_t behavior_cache_len = 0;
+
+static uint8_t zmk_keymap_behavior_index[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_LEN];
+
+#if ZMK_KEYMAP_HAS_SENSORS
+static uint8_t zmk_sensor_keymap_behavior_index[ZMK_KEYMAP_LAYERS_LEN][ZMK_KEYMAP_SENSORS_LEN];
+#endif /* ZMK_KEYMAP_HAS_SENSORS */
+
+static const struct device *resolve_behavior(uint8_t *index, const char *name) {
+    if (*index == BEHAVIOR_UNCACHED) {
+        return device_get_binding(name);
     }
 
-    // Default layer should *always* remain active
-    if (layer == _zmk_keymap_layer_default && !state) {
-        return 0;
+    if (*index != BEHAVIOR_UNRESOLVED) {
+        return behavior_cache[*index - 1].dev;
+    }
+
+    if (name == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < behavior_cache_len; i++) {
+        if (behavior_cache[i].name == name || strcmp(behavior_cache[i].name, name) == 0) {
+            *index = i + 1;
+            return behavior_cache[i].dev;
+        }
+    }
+
+    const struct device *dev = device_get_binding(name);
+
+    if (behavior_cache_len >= ARRAY_SIZE(behavior_cache)) {
+        LOG_WRN("Behavior cache is full, %s will be looked up on every use. Increase "
+                "CONFIG_ZMK_KEYMAP_BEHAVIOR_CACHE_SIZE",
+                log_strdup(name));
+        *index = BEHAVIOR_UNCACHED;
+        return dev;
+    }
+
+    behavior_cache[behavior_cache_len++] = (struct behavior_cache_entry){.name = name, .dev = dev};
+    *index = behavior_cache_len;
+
+    return dev;
+}
+
+static uint8_t find_effective_layer(uint32_t position) {
+    // The default layer is always active, and layers below it are never used.
+    zmk_keymap_layers_state_t default_layer = ZMK_KEYMAP_LAYER_BIT(_zmk_keymap_layer_default);
+    zmk_keymap_layers_state_t candidates = zmk_keymap_opaque_layers[position] &
+                                           (_zmk_keymap_layer_state | default_layer) &
+                                           ~(default_layer - 1);
+
+    if (candidates == 0) {
+        return _zmk_keymap_layer_default;
+    }
+
+    return zmk_keymap_layers_highest(candidates);
+}
+
+static void update_effective_layers(zmk_keymap_layers_state_t changed) {
+    // When several layers change at once, recomputing every position is cheaper than applying
+    // each layer on its own.
+    if (changed & (changed - 1)) {
+        for (int position = 0; position < ZMK_KEYMAP_LEN; position++) {
+            zmk_keymap_effective_layer[position] = find_effective_layer(position);
+        }
+        return;
+    }
+
+    uint8_t layer = zmk_keymap_layers_lowest(changed);
+    bool state = (_zmk_keymap_layer_state & changed) != 0;
+
+    for (int position = 0; position < ZMK_KEYMAP_LEN; position++) {
+        if ((zmk_keymap_opaque_layers[position] & changed) == 0) {
+            continue;
+        }
+
+        if (state) {
+            zmk_keymap_effective_layer[position] =
+                MAX(zmk_keymap_effective_layer[position], layer);
+        } else if (zmk_keymap_effective_layer[position] == layer) {
+            zmk_keymap_effective_layer[position] = find_effective_layer(position);
+        }
+    }
+}
+
+static void log_layer_changes(zmk_keymap_layers_state_t layers, bool state) {
+    for (int layer = ZMK_KEYMAP_LAYERS_LEN - 1; layer >= 0; layer--) {
+        if (layers & ZMK_KEYMAP_LAYER_BIT(layer)) {
+            LOG_DBG("layer_changed: layer %d state %d", layer, state);
+        }
+    }
+}
+
+static int set_layers_state(zmk_keymap_layers_state_t mask, zmk_keymap_layers_state_t state) {
+    if ((mask & ~ZMK_KEYMAP_LAYERS_MASK) != 0) {
+        return -EINVAL;
     }
 
     zmk_keymap_layers_state_t old_state = _zmk_keymap_layer_state;
-    WRITE_BIT(_zmk_keymap_layer_state, layer, state);
+    zmk_keymap_layers_state_t new_state = (old_state & ~mask) | (state & mask);
+
+    // Default layer should *always* remain active
+    new_state |= old_state & ZMK_KEYMAP_LAYER_BIT(_zmk_keymap_layer_default);
+
     // Don't send state changes unless there was an actual change
-    if (old_state != _zmk_keymap_layer_state) {
-        LOG_DBG("layer_changed: layer %d state %d", layer, state);
-        ZMK_EVENT_RAISE(create_layer_state_changed(layer, state));
+    zmk_keymap_layers_state_t changed = old_state ^ new_state;
+    if (changed == 0) {
+        return 0;
     }
 
+    _zmk_keymap_layer_state = new_state;
+    update_effective_layers(changed);
+
+    log_layer_changes(changed & old_state, false);
+    log_layer_changes(changed & new_state, true);
+
+    ZMK_EVENT_RAISE(create_layer_state_changed(old_state, new_state));
+
     return 0;
 }
 
+static inline int set_layer_state(uint8_t layer, bool state) {
+    if (layer >= ZMK_KEYMAP_LAYERS_LEN) {
+        return -EINVAL;
+    }
+
+    zmk_keymap_layers_state_t mask = ZMK_KEYMAP_LAYER_BIT(layer);
+
+    return set_layers_state(mask, state ? mask : 0);
+}
+
 uint8_t zmk_keymap_layer_default() { return _zmk_keymap_layer_default; }
 
 zmk_keymap_layers_state_t zmk_keymap_layer_state() { return _zmk_keymap_layer_state; }
@@ -108,7 +260,8 @@ zmk_keymap_layers_state_t zmk_keymap_layer_state() { return _zmk_keymap_layer_st
 bool zmk_keymap_layer_active_with_state(uint8_t layer, zmk_keymap_layers_state_t state_to_test) {
     // The default layer is assumed to be ALWAYS ACTIVE so we include an || here to ensure nobody
     // breaks up that assumption by accident
-    return (state_to_test & (BIT(layer))) == (BIT(layer)) || layer == _zmk_keymap_layer_default;
+    return (state_to_test & ZMK_KEYMAP_LAYER_BIT(layer)) == ZMK_KEYMAP_LAYER_BIT(layer) ||
+           layer == _zmk_keymap_layer_default;
 };
 
 bool zmk_keymap_layer_active(uint8_t layer) {
@@ -116,12 +269,8 @@ bool zmk_keymap_layer_active(uint8_t layer) {
 };
 
 uint8_t zmk_keymap_highest_layer_active() {
-    for (uint8_t layer = ZMK_KEYMAP_LAYERS_LEN - 1; layer > 0; layer--) {
-        if (zmk_keymap_layer_active(layer)) {
-            return layer;
-        }
-    }
-    return zmk_keymap_layer_default();
+    return zmk_keymap_layers_highest(_zmk_keymap_layer_state |
+                                     ZMK_KEYMAP_LAYER_BIT(_zmk_keymap_layer_default));
 }
 
 int zmk_keymap_layer_activate(uint8_t layer) { return set_layer_state(layer, true); };
@@ -137,17 +286,20 @@ int zmk_keymap_layer_toggle(uint8_t layer) {
 };
 
 int zmk_keymap_layer_to(uint8_t layer) {
-    for (int i = ZMK_KEYMAP_LAYERS_LEN - 1; i >= 0; i--) {
-        zmk_keymap_layer_deactivate(i);
+    if (layer >= ZMK_KEYMAP_LAYERS_LEN) {
+        return -EINVAL;
     }
 
-    zmk_keymap_layer_activate(layer);
+    return set_layers_state(ZMK_KEYMAP_LAYERS_MASK, ZMK_KEYMAP_LAYER_BIT(layer));
+}
 
-    return 0;
+int zmk_keymap_layer_state_set(zmk_keymap_layers_state_t mask, zmk_keymap_layers_state_t state) {
+    return set_layers_state(mask, state);
 }
 
 bool is_active_layer(uint8_t layer, zmk_keymap_layers_state_t layer_state) {
-    return (layer_state & BIT(layer)) == BIT(layer) || layer == _zmk_keymap_layer_default;
+    return (layer_state & ZMK_KEYMAP_LAYER_BIT(layer)) == ZMK_KEYMAP_LAYER_BIT(layer) ||
+           layer == _zmk_keymap_layer_default;
 }
 
 const char *zmk_keymap_layer_label(uint8_t layer) {
@@ -158,13 +310,19 @@ const char *zmk_keymap_layer_label(uint8_t layer) {
     return zmk_keymap_layer_names[layer];
 }
 
-int invoke_locally(struct zmk_behavior_binding *binding, struct zmk_behavior_binding_event event,
-                   bool pressed) {
-    if (pressed) {
-        return behavior_keymap_binding_pressed(binding, event);
-    } else {
-        return behavior_keymap_binding_released(binding, event);
+int invoke_locally(const struct device *behavior, struct zmk_behavior_binding *binding,
+                   struct zmk_behavior_binding_event event, bool pressed) {
+    // The device is already resolved, so call the driver directly rather than through
+    // behavior_keymap_binding_pressed/released, which would look it up by name again.
+    const struct behavior_driver_api *api = (const struct behavior_driver_api *)behavior->api;
+    behavior_keymap_binding_callback_t callback =
+        pressed ? api->binding_pressed : api->binding_released;
+
+    if (callback == NULL) {
+        return -ENOTSUP;
     }
+
+    return callback(binding, event);
 }
 
 int zmk_keymap_apply_position_state(uint8_t source, int layer, uint32_t position, bool pressed,
@@ -182,38 +340,35 @@ int zmk_keymap_apply_position_state(uint8_t source, int layer, uint32_t position
     LOG_DBG("layer: %d position: %d, binding name: %s", layer, position,
             log_strdup(binding.behavior_dev));
 
-    behavior = device_get_binding(binding.behavior_dev);
+    behavior = resolve_behavior(&zmk_keymap_behavior_index[layer][position], binding.behavior_dev);
 
     if (!behavior) {
         LOG_WRN("No behavior assigned to %d on layer %d", position, layer);
         return 1;
     }
 
-    int err = behavior_keymap_binding_convert_central_state_dependent_params(&binding, event);
-    if (err) {
-        LOG_ERR("Failed to convert relative to absolute behavior binding (err %d)", err);
-        return err;
-    }
+    const struct behavior_driver_api *api = (const struct behavior_driver_api *)behavior->api;
 
-    enum behavior_locality locality = BEHAVIOR_LOCALITY_CENTRAL;
-    err = behavior_get_locality(behavior, &locality);
-    if (err) {
-        LOG_ERR("Failed to get behavior locality %d", err);
-        return err;
+    if (api->binding_convert_central_state_dependent_params != NULL) {
+        int err = api->binding_convert_central_state_dependent_params(&binding, event);
+        if (err) {
+            LOG_ERR("Failed to convert relative to absolute behavior binding (err %d)", err);
+            return err;
+        }
     }
 
-    switch (locality) {
+    switch (api->locality) {
     case BEHAVIOR_LOCALITY_CENTRAL:
-        return invoke_locally(&binding, event, pressed);
+        return invoke_locally(behavior, &binding, event, pressed);
     case BEHAVIOR_LOCALITY_EVENT_SOURCE:
 #if ZMK_BLE_IS_CENTRAL
         if (source == ZMK_POSITION_STATE_CHANGE_SOURCE_LOCAL) {
-            return invoke_locally(&binding, event, pressed);
+            return invoke_locally(behavior, &binding, event, pressed);
         } else {
             return zmk_split_bt_invoke_behavior(source, &binding, event, pressed);
         }
 #else
-        return invoke_locally(&binding, event, pressed);
+        return invoke_locally(behavior, &binding, event, pressed);
 #endif
     case BEHAVIOR_LOCALITY_GLOBAL:
 #if ZMK_BLE_IS_CENTRAL
@@ -221,7 +376,7 @@ int zmk_keymap_apply_position_state(uint8_t source, int layer, uint32_t position
             zmk_split_bt_invoke_behavior(i, &binding, event, pressed);
         }
 #endif
-        return invoke_locally(&binding, event, pressed);
+        return invoke_locally(behavior, &binding, event, pressed);
     }
 
     return -ENOTSUP;
@@ -231,8 +386,13 @@ int zmk_keymap_position_state_changed(uint8_t source, uint32_t position, bool pr
                                       int64_t timestamp) {
     if (pressed) {
         zmk_keymap_active_behavior_layer[position] = _zmk_keymap_layer_state;
+        zmk_keymap_active_behavior_start[position] = zmk_keymap_effective_layer[position];
     }
-    for (int layer = ZMK_KEYMAP_LAYERS_LEN - 1; layer >= _zmk_keymap_layer_default; layer--) {
+
+    // Layers above the start layer are either inactive or &trans, so skip them. Anything else that
+    // turns out to be transparent at runtime still falls through to the layers below.
+    for (int layer = zmk_keymap_active_behavior_start[position];
+         layer >= _zmk_keymap_layer_default; layer--) {
         if (zmk_keymap_layer_active_with_state(layer, zmk_keymap_active_behavior_layer[position])) {
             int ret = zmk_keymap_apply_position_state(source, layer, position, pressed, timestamp);
             if (ret > 0) {
@@ -255,21 +415,30 @@ int zmk_keymap_sensor_triggered(uint8_t sensor_number, const struct device *sens
                                 int64_t timestamp) {
     for (int layer = ZMK_KEYMAP_LAYERS_LEN - 1; layer >= _zmk_keymap_layer_default; layer--) {
         if (zmk_keymap_layer_active(layer) && zmk_sensor_keymap[layer] != NULL) {
-            struct zmk_behavior_binding *binding = &zmk_sensor_keymap[layer][sensor_number];
+            // Behaviors take a mutable binding, but the sensor keymap is const.
+            struct zmk_behavior_binding binding = zmk_sensor_keymap[layer][sensor_number];
             const struct device *behavior;
             int ret;
 
             LOG_DBG("layer: %d sensor_number: %d, binding name: %s", layer, sensor_number,
-                    log_strdup(binding->behavior_dev));
+                    log_strdup(binding.behavior_dev));
 
-            behavior = device_get_binding(binding->behavior_dev);
+            behavior = resolve_behavior(&zmk_sensor_keymap_behavior_index[layer][sensor_number],
+                                        binding.behavior_dev);
 
             if (!behavior) {
                 LOG_DBG("No behavior assigned to %d on layer %d", sensor_number, layer);
                 continue;
             }
 
-            ret = behavior_sensor_keymap_binding_triggered(binding, sensor, timestamp);
+            const struct behavior_driver_api *api =
+                (const struct behavior_driver_api *)behavior->api;
+
+            if (api->sensor_binding_triggered == NULL) {
+                ret = -ENOTSUP;
+            } else {
+                ret = api->sensor_binding_triggered(&binding, sensor, timestamp);
+            }
 
             if (ret > 0) {
                 LOG_DBG("behavior processing to continue to next layer");
@@ -288,6 +457,340 @@ int zmk_keymap_sensor_triggered(uint8_t sensor_number, const struct device *sens
 
 #endif /* ZMK_KEYMAP_HAS_SENSORS */
 
+static void update_opaque_layers(uint32_t position) {
+#if DT_HAS_COMPAT_STATUS_OKAY(zmk_behavior_transparent)
+    const char *transparent = DT_LABEL(DT_INST(0, zmk_behavior_transparent));
+#else
+    const char *transparent = NULL;
+#endif
+
+    zmk_keymap_opaque_layers[position] = 0;
+
+    for (int layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+        const char *name = zmk_keymap[layer][position].behavior_dev;
+
+        if (name == NULL || (transparent != NULL && strcmp(name, transparent) == 0)) {
+            continue;
+        }
+
+        zmk_keymap_opaque_layers[position] |= ZMK_KEYMAP_LAYER_BIT(layer);
+    }
+
+    zmk_keymap_effective_layer[position] = find_effective_layer(position);
+}
+
+const struct zmk_behavior_binding *zmk_keymap_binding_get(uint8_t layer, uint32_t position) {
+    if (layer >= ZMK_KEYMAP_LAYERS_LEN || position >= ZMK_KEYMAP_LEN) {
+        return NULL;
+    }
+
+    return &zmk_keymap[layer][position];
+}
+
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SETTINGS_STORAGE)
+
+// All changed bindings are saved as a single settings value, so loading them at boot is one read
+// no matter how many bindings changed. The value is laid out as:
+//
+// struct keymap_settings_header
+// struct keymap_settings_binding[binding_count]
+// behavior_count NUL-terminated behavior names, referenced by index from the bindings
+#define KEYMAP_SETTINGS_VERSION 1
+
+struct keymap_settings_header {
+    uint8_t version;
+    uint8_t layers;
+    uint16_t positions;
+    uint16_t binding_count;
+    uint8_t behavior_count;
+} __packed;
+
+struct keymap_settings_binding {
+    uint8_t layer;
+    uint8_t behavior;
+    uint16_t position;
+    uint32_t param1;
+    uint32_t param2;
+} __packed;
+
+static uint32_t keymap_settings_save_count = 0;
+
+static bool behavior_names_equal(const char *a, const char *b) {
+    if (a == b) {
+        return true;
+    }
+
+    return a != NULL && b != NULL && strcmp(a, b) == 0;
+}
+
+static bool binding_changed(uint8_t layer, uint32_t position) {
+    const struct zmk_behavior_binding *binding = &zmk_keymap[layer][position];
+    const struct zmk_behavior_binding *original = &zmk_keymap_default[layer][position];
+
+    return binding->param1 != original->param1 || binding->param2 != original->param2 ||
+           !behavior_names_equal(binding->behavior_dev, original->behavior_dev);
+}
+
+static int find_behavior_name(const char *names, uint8_t count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names, name) == 0) {
+            return i;
+        }
+
+        names += strlen(names) + 1;
+    }
+
+    return -ENOENT;
+}
+
+static int keymap_settings_save() {
+    size_t size = sizeof(struct keymap_settings_header);
+    uint16_t binding_count = 0;
+
+    // Reserve room for every name, then only write each distinct one once.
+    for (int layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+        for (int position = 0; position < ZMK_KEYMAP_LEN; position++) {
+            if (binding_changed(layer, position)) {
+                size += sizeof(struct keymap_settings_binding) +
+                        strlen(zmk_keymap[layer][position].behavior_dev) + 1;
+                binding_count++;
+            }
+        }
+    }
+
+    if (binding_count == 0) {
+        return settings_delete("keymap/bindings");
+    }
+
+    uint8_t *value = k_malloc(size);
+    if (value == NULL) {
+        LOG_ERR("Not enough memory to save the keymap");
+        return -ENOMEM;
+    }
+
+    struct keymap_settings_header *header = (struct keymap_settings_header *)value;
+    struct keymap_settings_binding *records = (struct keymap_settings_binding *)(header + 1);
+    char *names = (char *)(records + binding_count);
+    char *names_end = names;
+
+    *header = (struct keymap_settings_header){
+        .version = KEYMAP_SETTINGS_VERSION,
+        .layers = ZMK_KEYMAP_LAYERS_LEN,
+        .positions = ZMK_KEYMAP_LEN,
+        .binding_count = binding_count,
+    };
+
+    struct keymap_settings_binding *record = records;
+    for (int layer = 0; layer < ZMK_KEYMAP_LAYERS_LEN; layer++) {
+        for (int position = 0; position < ZMK_KEYMAP_LEN; position++) {
+            if (!binding_changed(layer, position)) {
+                continue;
+            }
+
+            const struct zmk_behavior_binding *binding = &zmk_keymap[layer][position];
+            int behavior = find_behavior_name(names, header->behavior_count, binding->behavior_dev);
+
+            if (behavior < 0) {
+                if (header->behavior_count == UINT8_MAX) {
+                    LOG_ERR("Too many different behaviors to save the keymap");
+                    k_free(value);
+                    return -ENOMEM;
+                }
+
+                strcpy(names_end, binding->behavior_dev);
+                names_end += strlen(binding->behavior_dev) + 1;
+                behavior = header->behavior_count++;
+            }
+
+            *record++ = (struct keymap_settings_binding){
+                .layer = layer,
+                .behavior = behavior,
+                .position = position,
+                .param1 = binding->param1,
+                .param2 = binding->param2,
+            };
+        }
+    }
+
+    int len = names_end - (char *)value;
+    int err = settings_save_one("keymap/bindings", value, len);
+    k_free(value);
+
+    if (err < 0) {
+        LOG_ERR("Failed to save the keymap (err %d)", err);
+        return err;
+    }
+
+    keymap_settings_save_count++;
+    LOG_INF("Saved %d changed keymap bindings (%d bytes, %d saves since boot)", binding_count, len,
+            keymap_settings_save_count);
+
+    return 0;
+}
+
+static void keymap_settings_save_work(struct k_work *work) { keymap_settings_save(); }
+
+static struct k_work_delayable keymap_save_work;
+
+static int keymap_settings_load(const uint8_t *value, size_t len) {
+    const struct keymap_settings_header *header = (const struct keymap_settings_header *)value;
+
+    if (len < sizeof(*header) || header->version != KEYMAP_SETTINGS_VERSION) {
+        LOG_ERR("Ignoring saved keymap with an unknown format");
+        return -EINVAL;
+    }
+
+    if (header->layers != ZMK_KEYMAP_LAYERS_LEN || header->positions != ZMK_KEYMAP_LEN) {
+        LOG_WRN("Ignoring saved keymap, the keymap size has changed");
+        return -EINVAL;
+    }
+
+    // The records and names are used in place, straight from the value that was read.
+    const struct keymap_settings_binding *records =
+        (const struct keymap_settings_binding *)(header + 1);
+    const char *names = (const char *)(records + header->binding_count);
+    const char *end = (const char *)value + len;
+
+    // With the last name terminated, walking the names can never read past the end.
+    if (names > end || (names < end && end[-1] != '\0')) {
+        LOG_ERR("Ignoring truncated saved keymap");
+        return -EINVAL;
+    }
+
+    for (int i = 0; i < header->binding_count; i++) {
+        const struct keymap_settings_binding *record = &records[i];
+
+        if (record->behavior >= header->behavior_count || record->layer >= ZMK_KEYMAP_LAYERS_LEN ||
+            record->position >= ZMK_KEYMAP_LEN) {
+            LOG_WRN("Skipping invalid saved keymap binding");
+            continue;
+        }
+
+        const char *name = names;
+        for (int j = 0; j < record->behavior && name < end; j++) {
+            name += strlen(name) + 1;
+        }
+
+        if (name >= end) {
+            LOG_WRN("Skipping saved keymap binding with a missing behavior name");
+            continue;
+        }
+
+        // Store the device's own name so the binding doesn't point into the settings value.
+        const struct device *behavior = device_get_binding(name);
+        if (behavior == NULL) {
+            LOG_WRN("Skipping saved binding for unknown behavior %s", log_strdup(name));
+            continue;
+        }
+
+        zmk_keymap[record->layer][record->position] = (struct zmk_behavior_binding){
+            .behavior_dev = (char *)behavior->name,
+            .param1 = record->param1,
+            .param2 = record->param2,
+        };
+    }
+
+    return header->binding_count;
+}
+
+static int keymap_handle_set(const char *name, size_t len, settings_read_cb read_cb,
+                             void *cb_arg) {
+    if (!settings_name_steq(name, "bindings", NULL)) {
+        return 0;
+    }
+
+    uint32_t start = k_cycle_get_32();
+
+    uint8_t *value = k_malloc(len);
+    if (value == NULL) {
+        LOG_ERR("Not enough memory to load the saved keymap");
+        return -ENOMEM;
+    }
+
+    int err = read_cb(cb_arg, value, len);
+    if (err <= 0) {
+        LOG_ERR("Failed to read the saved keymap (err %d)", err);
+        k_free(value);
+        return err;
+    }
+
+    int count = keymap_settings_load(value, len);
+    k_free(value);
+
+    if (count >= 0) {
+        LOG_INF("Loaded %d changed keymap bindings (%d bytes) in %u us", count, (int)len,
+                k_cyc_to_us_floor32(k_cycle_get_32() - start));
+    }
+
+    return 0;
+}
+
+struct settings_handler keymap_settings_handler = {.name = "keymap", .h_set = keymap_handle_set};
+
+#endif /* IS_ENABLED(CONFIG_ZMK_KEYMAP_SETTINGS_STORAGE) */
+
+int zmk_keymap_binding_set(uint8_t layer, uint32_t position,
+                           const struct zmk_behavior_binding *binding) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SETTINGS_STORAGE)
+    if (layer >= ZMK_KEYMAP_LAYERS_LEN || position >= ZMK_KEYMAP_LEN) {
+        return -EINVAL;
+    }
+
+    const struct device *behavior = device_get_binding(binding->behavior_dev);
+    if (behavior == NULL) {
+        return -EINVAL;
+    }
+
+    zmk_keymap[layer][position] = (struct zmk_behavior_binding){
+        .behavior_dev = (char *)behavior->name,
+        .param1 = binding->param1,
+        .param2 = binding->param2,
+    };
+
+    zmk_keymap_behavior_index[layer][position] = BEHAVIOR_UNRESOLVED;
+    update_opaque_layers(position);
+
+    return k_work_reschedule(&keymap_save_work, K_MSEC(CONFIG_ZMK_SETTINGS_SAVE_DEBOUNCE));
+#else
+    return -ENOTSUP;
+#endif
+}
+
+int zmk_keymap_save_bindings() {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SETTINGS_STORAGE)
+    k_work_cancel_delayable(&keymap_save_work);
+    return keymap_settings_save();
+#else
+    return -ENOTSUP;
+#endif
+}
+
+static int zmk_keymap_init(const struct device *_arg) {
+#if IS_ENABLED(CONFIG_ZMK_KEYMAP_SETTINGS_STORAGE)
+    memcpy(zmk_keymap, zmk_keymap_default, sizeof(zmk_keymap));
+
+    settings_subsys_init();
+
+    int err = settings_register(&keymap_settings_handler);
+    if (err) {
+        LOG_ERR("Failed to register the keymap settings handler (err %d)", err);
+        return err;
+    }
+
+    k_work_init_delayable(&keymap_save_work, keymap_settings_save_work);
+
+    settings_load_subtree("keymap");
+#endif
+
+    for (int position = 0; position < ZMK_KEYMAP_LEN; position++) {
+        update_opaque_layers(position);
+    }
+
+    return 0;
+}
+
+SYS_INIT(zmk_keymap_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
 int keymap_listener(const zmk_event_t *eh) {
     const struct zmk_position_state_changed *pos_ev;
     if ((pos_ev = as_zmk_position_state_changed(eh)) != NULL) {
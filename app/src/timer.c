@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2022 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <kernel.h>
+#include <limits.h>
+#include <logging/log.h>
+#include <sys/util.h>
+
+#if IS_ENABLED(CONFIG_SHELL)
+#include <shell/shell.h>
+#endif
+
+#include <zmk/event_manager.h>
+#include <zmk/timer.h>
+
+LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+// pending timers, sorted by deadline. Timers with equal deadlines expire in the order they were
+// started.
+static sys_dlist_t timers = SYS_DLIST_STATIC_INIT(&timers);
+static struct k_spinlock lock;
+// the deadline timer_work is currently scheduled for, or LLONG_MAX if it is not scheduled.
+static int64_t scheduled_deadline = LLONG_MAX;
+
+static void timer_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(timer_work, timer_work_handler);
+
+static int64_t first_deadline_locked(void) {
+    struct zmk_timer *first = SYS_DLIST_PEEK_HEAD_CONTAINER(&timers, first, node);
+    return first == NULL ? LLONG_MAX : first->deadline;
+}
+
+static void schedule_first_locked(void) {
+    int64_t deadline = first_deadline_locked();
+    if (deadline == scheduled_deadline) {
+        return;
+    }
+    scheduled_deadline = deadline;
+    if (deadline == LLONG_MAX) {
+        k_work_cancel_delayable(&timer_work);
+        return;
+    }
+    k_work_reschedule_for_queue(zmk_event_manager_work_q(), &timer_work,
+                                K_MSEC(MAX(deadline - k_uptime_get(), 0)));
+}
+
+static void timer_work_handler(struct k_work *work) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    scheduled_deadline = LLONG_MAX;
+
+    int64_t now = k_uptime_get();
+    struct zmk_timer *timer;
+    while ((timer = SYS_DLIST_PEEK_HEAD_CONTAINER(&timers, timer, node)) != NULL &&
+           timer->deadline <= now) {
+        sys_dlist_remove(&timer->node);
+        // the handler may start or cancel timers, including this one.
+        k_spin_unlock(&lock, key);
+        timer->handler(timer);
+        key = k_spin_lock(&lock);
+    }
+
+    schedule_first_locked();
+    k_spin_unlock(&lock, key);
+}
+
+void zmk_timer_init(struct zmk_timer *timer, zmk_timer_handler_t handler) {
+    sys_dnode_init(&timer->node);
+    timer->deadline = 0;
+    timer->handler = handler;
+}
+
+void zmk_timer_start(struct zmk_timer *timer, int64_t deadline) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (sys_dnode_is_linked(&timer->node)) {
+        if (timer->deadline == deadline) {
+            k_spin_unlock(&lock, key);
+            return;
+        }
+        sys_dlist_remove(&timer->node);
+    }
+    timer->deadline = deadline;
+
+    // timers are usually started with a deadline at or after the ones already pending, so search
+    // from the back to make the common case constant time.
+    struct zmk_timer *prev = SYS_DLIST_PEEK_TAIL_CONTAINER(&timers, prev, node);
+    while (prev != NULL && prev->deadline > deadline) {
+        prev = SYS_DLIST_PEEK_PREV_CONTAINER(&timers, prev, node);
+    }
+    struct zmk_timer *next = prev == NULL ? SYS_DLIST_PEEK_HEAD_CONTAINER(&timers, next, node)
+                                          : SYS_DLIST_PEEK_NEXT_CONTAINER(&timers, prev, node);
+    if (next == NULL) {
+        sys_dlist_append(&timers, &timer->node);
+    } else {
+        sys_dlist_insert(&next->node, &timer->node);
+    }
+
+    schedule_first_locked();
+    k_spin_unlock(&lock, key);
+}
+
+void zmk_timer_cancel(struct zmk_timer *timer) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (sys_dnode_is_linked(&timer->node)) {
+        sys_dlist_remove(&timer->node);
+        schedule_first_locked();
+    }
+    k_spin_unlock(&lock, key);
+}
+
+bool zmk_timer_is_pending(const struct zmk_timer *timer) {
+    return sys_dnode_is_linked(&timer->node);
+}
+
+int64_t zmk_timer_next_deadline(void) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    int64_t deadline = first_deadline_locked();
+    k_spin_unlock(&lock, key);
+    return deadline;
+}
+
+#if IS_ENABLED(CONFIG_SHELL)
+
+#define SHELL_TIMERS_MAX 16
+
+static int cmd_timers(const struct shell *shell, size_t argc, char **argv) {
+    struct zmk_timer pending[SHELL_TIMERS_MAX];
+    int count = 0;
+
+    // copy the pending timers so nothing is printed with the lock held.
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    int64_t now = k_uptime_get();
+    struct zmk_timer *timer;
+    SYS_DLIST_FOR_EACH_CONTAINER(&timers, timer, node) {
+        if (count < SHELL_TIMERS_MAX) {
+            pending[count] = *timer;
+        }
+        count++;
+    }
+    k_spin_unlock(&lock, key);
+
+    shell_print(shell, "%d pending timers", count);
+    for (int i = 0; i < MIN(count, SHELL_TIMERS_MAX); i++) {
+        shell_print(shell, "  handler %p due in %lld ms", (void *)pending[i].handler,
+                    (long long)(pending[i].deadline - now));
+    }
+    return 0;
+}
+
+SHELL_CMD_REGISTER(timers, NULL, "Print the pending ZMK behavior timers", cmd_timers);
+
+#endif /* IS_ENABLED(CONFIG_SHELL) */